@@ -0,0 +1,243 @@
+/**
+ * @file lock_stats.h
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Optional contention and hold time counters for allocator locks
+ * @version 1.0
+ * @date 2023-11-16
+ *
+ *
+ * With MELLOC_LOCK_STATS set, mutBin, mutArena and mutMelloc are wrapped in
+ * ProfiledMutex. Every lock is first tried without blocking; only when that
+ * fails is the wait timed, so uncontended acquisitions cost one tick read for
+ * the hold time. Hold time is only kept for exclusive locks, since shared
+ * holders overlap. Counting can be switched off at runtime, which leaves a
+ * relaxed load per lock. Without MELLOC_LOCK_STATS the plain std mutexes are
+ * used and none of this is compiled.
+ *
+ * With MELLOC_SINGLE_THREADED the locks are NullMutex, and the allocator's
+ * atomics (MellocAtomic) plain variables, so both compile away.
+ *
+ * Times are in ticks: TSC cycles on x86, ns elsewhere.
+ *
+ */
+
+#ifndef UTIL_MELLOC_LOCK_STATS_H
+#define UTIL_MELLOC_LOCK_STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <mutex>
+#include <shared_mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "melloc_defs.h"
+
+
+struct LockStats {
+    std::uint64_t   acquisitions    {0};
+    std::uint64_t   contended       {0};    /* acquisitions that had to wait */
+    std::uint64_t   waitTicks       {0};
+    std::uint64_t   maxWaitTicks    {0};
+    std::uint64_t   holdTicks       {0};    /* exclusive holds only */
+    std::uint64_t   maxHoldTicks    {0};
+
+    LockStats& operator+=(const LockStats& other) noexcept {
+        acquisitions += other.acquisitions;
+        contended += other.contended;
+        waitTicks += other.waitTicks;
+        maxWaitTicks = std::max(maxWaitTicks, other.maxWaitTicks);
+        holdTicks += other.holdTicks;
+        maxHoldTicks = std::max(maxHoldTicks, other.maxHoldTicks);
+        return *this;
+    }
+};
+
+#if MELLOC_LOCK_STATS
+
+inline std::atomic<bool> lockStatsEnabled {true};
+
+inline std::uint64_t lockTicks() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+template <typename Mutex>
+class ProfiledMutex {
+public:
+    void lock() {
+        if (!lockStatsEnabled.load(std::memory_order_relaxed)) {
+            mut.lock();
+            holdStart = 0;
+            return;
+        }
+        countWait(mut.try_lock() ? 0 : timedWait([this]() { mut.lock(); }));
+        holdStart = lockTicks();
+    }
+
+    bool try_lock() {
+        if (!mut.try_lock()) {
+            return false;
+        }
+        holdStart = 0;
+        if (lockStatsEnabled.load(std::memory_order_relaxed)) {
+            countWait(0);
+            holdStart = lockTicks();
+        }
+        return true;
+    }
+
+    void unlock() {
+        if (holdStart) {
+            std::uint64_t held = lockTicks() - holdStart;
+            holdTicks.fetch_add(held, std::memory_order_relaxed);
+            storeMax(maxHoldTicks, held);
+        }
+        mut.unlock();
+    }
+
+    void lock_shared() {
+        if (!lockStatsEnabled.load(std::memory_order_relaxed)) {
+            mut.lock_shared();
+            return;
+        }
+        countWait(mut.try_lock_shared() ? 0 : timedWait([this]() { mut.lock_shared(); }));
+    }
+
+    bool try_lock_shared() {
+        if (!mut.try_lock_shared()) {
+            return false;
+        }
+        if (lockStatsEnabled.load(std::memory_order_relaxed)) {
+            countWait(0);
+        }
+        return true;
+    }
+
+    void unlock_shared() {
+        mut.unlock_shared();
+    }
+
+    LockStats stats() const noexcept {
+        LockStats out;
+        out.acquisitions = acquisitions.load(std::memory_order_relaxed);
+        out.contended = contended.load(std::memory_order_relaxed);
+        out.waitTicks = waitTicks.load(std::memory_order_relaxed);
+        out.maxWaitTicks = maxWaitTicks.load(std::memory_order_relaxed);
+        out.holdTicks = holdTicks.load(std::memory_order_relaxed);
+        out.maxHoldTicks = maxHoldTicks.load(std::memory_order_relaxed);
+        return out;
+    }
+
+    void resetStats() noexcept {
+        for (std::atomic<std::uint64_t>* counter : {&acquisitions, &contended, &waitTicks,
+                                                    &maxWaitTicks, &holdTicks, &maxHoldTicks}) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    template <typename Fn>
+    static std::uint64_t timedWait(Fn acquire) {
+        std::uint64_t start = lockTicks();
+        acquire();
+        return std::max<std::uint64_t>(lockTicks() - start, 1);
+    }
+
+    void countWait(std::uint64_t waited) noexcept {
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (waited) {
+            contended.fetch_add(1, std::memory_order_relaxed);
+            waitTicks.fetch_add(waited, std::memory_order_relaxed);
+            storeMax(maxWaitTicks, waited);
+        }
+    }
+
+    static void storeMax(std::atomic<std::uint64_t>& max, std::uint64_t val) noexcept {
+        std::uint64_t cur = max.load(std::memory_order_relaxed);
+        while (cur < val && !max.compare_exchange_weak(cur, val, std::memory_order_relaxed)) {}
+    }
+
+    Mutex                           mut;
+    std::uint64_t                   holdStart       {0};    /* written by the exclusive holder */
+    std::atomic<std::uint64_t>      acquisitions    {0};
+    std::atomic<std::uint64_t>      contended       {0};
+    std::atomic<std::uint64_t>      waitTicks       {0};
+    std::atomic<std::uint64_t>      maxWaitTicks    {0};
+    std::atomic<std::uint64_t>      holdTicks       {0};
+    std::atomic<std::uint64_t>      maxHoldTicks    {0};
+};
+
+using MellocMutex = ProfiledMutex<std::mutex>;
+using MellocSharedMutex = ProfiledMutex<std::shared_mutex>;
+
+#elif MELLOC_SINGLE_THREADED
+
+struct NullMutex {
+    void lock() noexcept {}
+    bool try_lock() noexcept { return true; }
+    void unlock() noexcept {}
+    void lock_shared() noexcept {}
+    bool try_lock_shared() noexcept { return true; }
+    void unlock_shared() noexcept {}
+};
+
+using MellocMutex = NullMutex;
+using MellocSharedMutex = NullMutex;
+
+#else
+
+using MellocMutex = std::mutex;
+using MellocSharedMutex = std::shared_mutex;
+
+#endif // MELLOC_LOCK_STATS
+
+#if MELLOC_SINGLE_THREADED
+
+/*  The subset of std::atomic the allocator uses, on a plain variable. Not for
+    anything a signal handler writes */
+template <typename T>
+class PlainAtomic {
+public:
+    constexpr PlainAtomic(T val = T()) noexcept : val(val) {}
+
+    T load(std::memory_order = std::memory_order_seq_cst) const noexcept {
+        return val;
+    }
+
+    void store(T desired, std::memory_order = std::memory_order_seq_cst) noexcept {
+        val = desired;
+    }
+
+    T fetch_add(T arg, std::memory_order = std::memory_order_seq_cst) noexcept {
+        T old = val;
+        val += arg;
+        return old;
+    }
+
+private:
+    T val;
+};
+
+template <typename T>
+using MellocAtomic = PlainAtomic<T>;
+
+#else
+
+template <typename T>
+using MellocAtomic = std::atomic<T>;
+
+#endif // MELLOC_SINGLE_THREADED
+
+
+
+#endif // UTIL_MELLOC_LOCK_STATS_H
@@ -14,6 +14,7 @@
 
 #include <atomic>
 #include <array>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -22,12 +23,14 @@
 #include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 #ifdef __linux__
 #include <sys/mman.h>
 #include <signal.h>
 #endif // __linux__
 
 #include "arena.h"
+#include "lock_stats.h"
 #include "melloc_defs.h"
 #include "melloc_utils.h"
 
@@ -44,26 +47,80 @@ class Melloc {
     struct ThreadDescriptorWrapper;
     struct ThreadDescriptor;
 
+public:
+    /*  Expected lifetime of an allocation, see allocate(n, lifetime) */
+    enum class Lifetime : std::uint8_t {
+        Short,      /* request-scoped garbage, and anything not hinted */
+        Long        /* outlives many short-lived objects, eg. cache entries */
+    };
+
+    static constexpr std::size_t numLifetimes = 2;
+
+    /*  Subsystem an allocation is charged to, below MAX_TAGS. Untagged
+        allocations are not counted */
+    using Tag = std::uint16_t;
+
+    static constexpr Tag untagged = 0;
+
+    /*  Handle of an explicit cache, see createCache() */
+    enum class CacheId : std::uint32_t {};
+
+    /*  Where an arena gets its pages, see setExtentHooks(). Every hook gets the
+        arena's index and arg, and returns false on failure. The defaults are
+        melloc's own mmap-based ones */
+    struct ExtentHooks {
+        /*  Map len zeroed bytes for a new extent, or nullptr. Used when the
+            arena has no region to carve from, or commit is null */
+        void*   (*alloc)(std::size_t len, std::size_t arena, void* arg)         {nullptr};
+        /*  Take back an extent from alloc. If it can't, the arena purges the
+            extent and keeps it for reuse */
+        bool    (*dalloc)(void* addr, std::size_t len, std::size_t arena, void* arg)
+                                                                                {nullptr};
+        /*  Make reserved pages of the arena's region usable */
+        bool    (*commit)(void* addr, std::size_t len, std::size_t arena, void* arg)
+                                                                                {nullptr};
+        /*  Return committed pages of the region to reserved, when a private
+            arena is destroyed */
+        bool    (*decommit)(void* addr, std::size_t len, std::size_t arena, void* arg)
+                                                                                {nullptr};
+        /*  Drop the contents of a free extent so it reads back as zero. If it
+            can't, the arena clears the extent itself */
+        bool    (*purge)(void* addr, std::size_t len, std::size_t arena, void* arg)
+                                                                                {nullptr};
+        /*  May a free extent be split at first bytes to reuse its head? Null
+            means always */
+        bool    (*split)(void* addr, std::size_t len, std::size_t first,
+                         std::size_t arena, void* arg)                          {nullptr};
+        /*  May two adjacent free extents be merged? Null means always */
+        bool    (*merge)(void* a, std::size_t aLen, void* b, std::size_t bLen,
+                         std::size_t arena, void* arg)                          {nullptr};
+        void*   arg     {nullptr};
+    };
+
+private:
     friend struct Arena;
-    struct Arena {
+    struct alignas(CACHE_LINE_SIZE) Arena {
         struct PageDescriptor {
             PageDescriptor() = delete;
 
             PageDescriptor(Page page) : page(page) {}
 
             /*  Construct for large object */
-            PageDescriptor(Page page, std::size_t len, bool isSlab)
+            PageDescriptor(Page page, std::size_t len, bool isSlab, Lifetime lifetime)
                 : page(page)
                 , isSlab(isSlab)
+                , lifetime(lifetime)
             {
                 assert(!isSlab);
                 sizeInfo.len = len;
             }
 
             /*  Construct for slab */
-            PageDescriptor(Page page, std::size_t binIdx, std::size_t consecutive, bool isSlab)
+            PageDescriptor(Page page, std::size_t binIdx, std::size_t consecutive, bool isSlab,
+                           Lifetime lifetime)
                 : page(page)
                 , isSlab(isSlab)
+                , lifetime(lifetime)
             {
                 assert(isSlab);
                 sizeInfo.slab.binIdx = binIdx;
@@ -91,43 +148,229 @@ class Melloc {
             SizeInfo    sizeInfo    {0};
             Page        page        {0};
             bool        isSlab      {false};
+            Lifetime    lifetime    {Lifetime::Short};
         }; // struct PageDescriptor
 
-        /*  A bin owns a slab and tracks free chunks for every small size class */
+        /*  A bin owns a slab and tracks free chunks for every small size class.
+            Bins sit next to each other in an arena, so each gets its own cache
+            lines to keep one class's lock traffic off its neighbours */
         friend struct Bin;
-        struct Bin {
+        struct alignas(CACHE_LINE_SIZE) Bin {
+            /*  Occupancy of one slab, keyed in slabs by its first chunk. That is
+                the start of the slab's first page plus its color */
+            struct SlabInfo {
+                std::size_t     nObjs;
+                std::size_t     nFree;
+                bool            releasable; /* cleared when reserve() pins it */
+                /*  Chunks from here to the end of the slab were never handed
+                    out. Chunks are taken lowest address first within a slab,
+                    so this only moves up */
+                void*           untouched;
+            };
+
+            using SlabMap = std::map<void*, SlabInfo>;
+
             Bin() {}
 
-            void* allocate();
+            /*  If isZeroed is given, it is set when the chunk has never been
+                handed out since its slab was mapped, so it is still all zero */
+            void* allocate(bool* isZeroed = nullptr);
+
+            /*  Returns how many of count chunks were taken, fewer only if
+                a slab was needed and the thread may not map one */
+            std::size_t allocateBatch(void** out, std::size_t count);
+
+            /*  Returns 0 if a slab was needed and the thread may not map one */
+            std::size_t takeRun(void** out, std::size_t count, bool* isZeroed);
+
+            /*  Carve a fresh slab out of the arena and track it. Returns its
+                first chunk, or nullptr if the thread may not map one. Caller
+                holds mutBin */
+            void* mapSlab();
+
+            /*  Prefault and pin slabs until count chunks are free */
+            bool reserve(std::size_t count, bool lockPages);
 
             void giveBack(void* ptr);
 
+            void giveBackBatch(void** ptrs, std::size_t count);
+
+            void giveBackLocked(void* ptr);
+
+            /*  Track a fresh slab whose chunks are all free and zero */
+            void addSlab(void* slab, std::size_t objs);
+
+            /*  Unmap every empty slab. Returns the number of bytes released */
+            std::size_t releaseEmptySlabs() noexcept;
+
+            /*  Forget every chunk handed out. With retain set, slabs are kept
+                and become entirely free, otherwise they are forgotten too and
+                the caller unmaps them */
+            void reset(bool retain) noexcept;
+
+            /*  Free run to allocate from next, according to slabPolicy */
+            std::map<void*, std::size_t>::iterator pickChunk() noexcept;
+
+            /*  Slab containing ptr. Caller holds mutBin */
+            SlabMap::iterator findSlab(void* ptr) noexcept;
+
+            /*  Move a slab between partialSlabs and emptySlabs as needed */
+            void setFree(SlabMap::iterator slabIt, std::size_t nFree) noexcept;
+
             // Bin members
             std::size_t                     myArena;
             std::size_t                     binIdx;
-            std::mutex                      mutBin;
+            Lifetime                        lifetime    {Lifetime::Short};
+            MellocMutex                     mutBin;
             /*  binFreeChunks stores pointers to available chunks, along
-                with how many consecutive free pages are after it. We preferentially
-                allocate from the lowest address of binFreeChunks */
-            std::map<void*, std::size_t>  binFreeChunks;
+                with how many consecutive free chunks are after it. A run never
+                crosses a slab boundary */
+            std::map<void*, std::size_t>    binFreeChunks;
+            SlabMap                         slabs;
+            /*  Slabs with some but not all chunks free, ordered by free count,
+                so the fullest one is first */
+            std::set<std::pair<std::size_t, void*>>
+                                            partialSlabs;
+            /*  Slabs with every chunk free, candidates for release */
+            std::set<void*>                 emptySlabs;
+            /*  Color the next slab gets, modulo the number that fit its tail */
+            std::size_t                     nextColor   {0};
         }; // struct Bin
 
-        Arena();
+        Arena() = delete;
+
+        Arena(std::size_t id, bool isPrivate, std::size_t node);
 
         [[nodiscard]]
-        void* allocate(std::size_t sz, ThreadDescriptorWrapper& tdw);
+        void* allocate(std::size_t sz, ThreadDescriptor& td);
 
-        void deallocate(void* ptr) noexcept;
+        /*  Allocate without going through any thread cache */
+        [[nodiscard]]
+        void* allocate(std::size_t sz, Lifetime lifetime = Lifetime::Short);
+
+        [[nodiscard]]
+        void* allocateLarge(std::size_t sz, bool* isZeroed = nullptr,
+                            Lifetime lifetime = Lifetime::Short);
+
+        /*  Like allocate(), but clears the chunk unless it is known to be zero */
+        [[nodiscard]]
+        void* allocateZeroed(std::size_t sz, std::size_t n, ThreadDescriptor& td);
+
+        /*  Returns false if ptr does not belong to this arena */
+        bool deallocate(void* ptr) noexcept;
+
+        bool owns(void* ptr) noexcept;
+
+        /*  Bytes usable at ptr, ie. its size class or large object length, or
+            0 if ptr does not belong to this arena */
+        std::size_t usableSize(void* ptr) noexcept;
+
+        /*  Bin of the slab holding ptr, or bins.size() if ptr is not a short-lived
+            small chunk of this arena, ie. may not be cached */
+        std::size_t binOf(void* ptr) noexcept;
+
+        std::set<PageDescriptor>::iterator findUsedPage(void* ptr) noexcept;
+
+        /*  Free without going through any thread cache */
+        void deallocateDirect(void* ptr) noexcept;
+
+        /*  Free the leading pointers of a sorted array that share the slab (or
+            large object) of ptrs[0], all with one lookup. Chunks go to td's
+            cache first if given. Returns how many pointers were consumed, 0
+            if ptrs[0] is not from this arena */
+        std::size_t deallocateRun(void** ptrs, std::size_t count,
+                                  ThreadDescriptor* td) noexcept;
+
+        /*  Drop every slab and large object owned by this arena */
+        void reset(bool retain) noexcept;
+
+        /*  Take len bytes of zeroed pages from the region: the lowest free
+            extent that fits, else the top of the region, committing more of
+            it if needed. Returns nullptr if that needs a syscall and the
+            thread may not make one. Caller holds mutArena */
+        void* mapExtent(std::size_t len);
+
+        /*  Return an extent. Its pages go back to the kernel, the address
+            range stays with the region for reuse. Caller holds mutArena */
+        void unmapExtent(void* ptr, std::size_t len) noexcept;
+
+        /*  Free extents at a and b, a first, may become one */
+        bool canMerge(void* a, std::size_t aLen, void* b, std::size_t bLen) noexcept;
+
+        /*  Hand the committed region and any kept extents back to the hooks.
+            Only for an arena that holds nothing, before it is destroyed */
+        void decommit() noexcept;
+
+        /*  ptr lies in the part of the region handed out so far */
+        inline bool inRegion(void* ptr) const noexcept {
+            return static_cast<char*>(ptr) >= regionBase && static_cast<char*>(ptr) < regionTop;
+        }
+
+        inline std::array<Bin, smallSizeClasses.size()>& binsFor(Lifetime lifetime) noexcept {
+            return lifetime == Lifetime::Long ? longLivedBins : bins;
+        }
+
+        /*  Call fn on every bin, short-lived ones first */
+        template <typename Fn>
+        inline void forEachBin(Fn fn) {
+            for (Bin& b : bins) {
+                fn(b);
+            }
+            for (Bin& b : longLivedBins) {
+                fn(b);
+            }
+        }
 
         void init();
 
         // Arena members
-        std::size_t                                 id {0};
+        std::size_t                                 id          {0};
+        bool                                        isPrivate   {false};
+        std::size_t                                 node        {0};
         std::array<Bin, smallSizeClasses.size()>    bins;
+        /*  Long-lived objects get slabs of their own, so they don't keep the
+            churning short-lived slabs from emptying. Never cached */
+        std::array<Bin, smallSizeClasses.size()>    longLivedBins;
         std::set<PageDescriptor>                    arenaUsedPages;
-        std::shared_mutex                           mutArena;
+        MellocSharedMutex                           mutArena;
+        char*                                       regionBase      {nullptr};
+        char*                                       regionTop       {nullptr};
+        char*                                       regionCommitted {nullptr};
+        /*  Extents given back below regionTop, by address, with their length,
+            and those the hooks' dalloc would not take */
+        std::map<void*, std::size_t>                freeExtents;
+        ExtentHooks                                 hooks;
     }; // struct Arena
 
+    /*  NUMA layout of the machine, read once from sysfs. If MELLOC_NUMA_NODES
+        is set in the environment, that many nodes are simulated instead by
+        spreading the CPUs across them, and nothing is actually bound */
+    struct Topology {
+        Topology();
+
+        std::size_t                                 numNodes    {1};
+        bool                                        simulated   {false};
+        std::array<std::uint16_t, MAX_CPUS>         cpuToNode   {0};
+    }; // struct Topology
+
+#if MELLOC_PERCPU_CACHE
+    /*  Small chunks cached for one CPU, all from the arena serving that CPU.
+        Laid out like a thread cache at full capacity, with the slots right
+        after the struct. Only ever touched from inside an rseq critical
+        section on that CPU */
+    struct CpuCache {
+        inline void** slots() noexcept {
+            return reinterpret_cast<void**>(this + 1);
+        }
+
+        static inline std::size_t bytes() noexcept {
+            return sizeof(CpuCache) + mellocConf.tcacheOffsets.back() * sizeof(void*);
+        }
+
+        alignas(void*) std::array<std::uint32_t, smallSizeClasses.size()>  tops    {0};
+    }; // struct CpuCache
+#endif // MELLOC_PERCPU_CACHE
+
     /*  Wrapper class for ThreadDescriptor */
     friend struct ThreadDescriptorWrapper;
 #ifdef __linux
@@ -154,6 +397,10 @@ class Melloc {
             return &(*td);
         }
 
+        inline ThreadDescriptor* get() {
+            return td.get();
+        }
+
         inline bool operator ==(const ThreadDescriptorWrapper& other) const noexcept {
             assert(td && other.td);
             return (td->tid == other.td->tid);
@@ -169,44 +416,142 @@ class Melloc {
         std::unique_ptr<ThreadDescriptor> td {nullptr};
     }; // struct ThreadDescriptorWrapper
 
+public:
+    /*  Counters of one thread cache bin */
+    struct CacheBinStats {
+        std::size_t     hits        {0};    /* allocations served from cache */
+        std::size_t     misses      {0};    /* allocations that went to the bin */
+        std::size_t     overflows   {0};    /* frees that did not fit */
+        std::size_t     capacity    {0};
+        std::size_t     cached      {0};
+    };
+
+private:
     /*  A ThreadDescriptor most importantly stores the recently freed chunks per
         thread, which we scan prior to allocating through the Arena, to reduce peak 
-        lock contention */
+        lock contention. Descriptors are allocated one by one, and aligned so
+        that two threads' cache tops never share a line */
     friend struct ThreadDescriptor;
-    struct ThreadDescriptor {
-        using BinCache = std::array<void*, THREAD_CACHE_SIZE>;
-
+    struct alignas(CACHE_LINE_SIZE) ThreadDescriptor {
         ThreadDescriptor() = delete;
 
         ThreadDescriptor(const ThreadDescriptor& other) = delete;
 
         explicit ThreadDescriptor(std::thread::id tid);
 
-        ~ThreadDescriptor() {};
+        /*  Explicit cache on arena, see createCache(). It has no owning
+            thread and no purge timer */
+        explicit ThreadDescriptor(std::size_t arena);
+
+        ~ThreadDescriptor();
+
+        /*  Start every cache bin at its default capacity, with fresh counters */
+        void resetCapacity() noexcept;
+
+        /*  Bind to a (new) thread: pick its arena and start a purge timer
+            that signals that thread. Must be called by the thread itself */
+        void attach(std::thread::id tid);
+
+        /*  Owning thread exited: flush the cache and delete the purge timer */
+        void detach() noexcept;
 
         void pushCache(void* ptr, std::size_t sizeClassIdx) noexcept;
 
         void* popCache(std::size_t sizeClassIdx) noexcept;
 
+        /*  Push up to count chunks, returns how many fit */
+        std::size_t pushCacheBatch(void** ptrs, std::size_t count,
+                                   std::size_t sizeClassIdx) noexcept;
+
+        /*  Pop up to count chunks, returns how many were cached */
+        std::size_t popCacheBatch(void** out, std::size_t count,
+                                  std::size_t sizeClassIdx) noexcept;
+
+        /*  How many chunks to take from the bin on a cache miss */
+        std::size_t fillCount(std::size_t sizeClassIdx) const noexcept;
+
         void purge();
 
-        void decay(std::size_t sizeClassIdx) noexcept;
+        /*  What the owner should do on its next cache op. The timer asks for
+            a Decay purge, the pressure watcher for a Release */
+        enum PurgeRequest : std::uint8_t {
+            NoPurge,
+            DecayPurge,
+            ReleasePurge
+        };
+
+        /*  Run a purge the timer or pressure watcher asked for. Called by the
+            owning thread on entry to every cache op, where it holds no locks,
+            so the hit path is a relaxed load and plain stores only */
+        inline void servicePurge() noexcept {
+            if (purgeRequested.load(std::memory_order_relaxed) != NoPurge && !purgeHeld) {
+                if (purgeRequested.exchange(NoPurge, std::memory_order_relaxed) == ReleasePurge) {
+                    release();
+                }
+                else {
+                    purge();
+                }
+            }
+        }
+
+        /*  Give every cached chunk back to its bin */
+        void flush() noexcept;
+
+        /*  Flush and halve every cache bin's capacity, under memory pressure */
+        void release() noexcept;
+
+        /*  Stop the purge timer and hold off purge requests, for no-syscall
+            mode */
+        void pausePurge() noexcept;
+
+        /*  Rearm the purge timer and run any purge that was held off */
+        void resumePurge() noexcept;
+
+        /*  Double a cache bin's capacity, within its maximum and the budget */
+        void grow(std::size_t sizeClassIdx) noexcept;
+
+        /*  Halve a cache bin's capacity, giving back what no longer fits */
+        void shrink(std::size_t sizeClassIdx) noexcept;
+
+        inline void** cacheBin(std::size_t sizeClassIdx) noexcept {
+            return &cache[mellocConf.tcacheOffsets[sizeClassIdx]];
+        }
 
         // ThreadDescriptor members
         std::size_t                                             myArena;
         std::thread::id                                         tid;
-        std::array<BinCache, smallSizeClasses.size()>           cache       {0};
+        std::unique_ptr<void*[]>                                cache;
         std::array<std::size_t, smallSizeClasses.size()>        topIdxs     {0};
+        std::array<std::size_t, smallSizeClasses.size()>        capacity    {0};
+        std::array<std::size_t, smallSizeClasses.size()>        pressure    {0};
         std::array<std::size_t, smallSizeClasses.size()>        decayRate   {0};
-        std::array<std::atomic_flag, smallSizeClasses.size()>   usedFlags;
+        std::array<std::size_t, smallSizeClasses.size()>        idleTicks   {0};
+        std::array<CacheBinStats, smallSizeClasses.size()>      cacheStats  {};
+        std::size_t                                             capacityBytes {0};
+        std::atomic<std::uint8_t>                               purgeRequested {NoPurge};
+        bool                                                    purgeHeld   {false};
 #ifdef __linux__
         struct sigaction                                        sa;
         struct sigevent                                         sev;
         struct itimerspec                                       its;
         timer_t                                                 timerObj;
+        bool                                                    hasTimer    {false};
 #endif
     }; // struct ThreadDescriptor
 
+    using ThreadDescriptorMap = std::unordered_map<std::thread::id,
+                                                   ThreadDescriptorWrapper,
+                                                   ThreadDescriptorWrapper::hash>;
+
+    /*  A thread_local ThreadExitHook is touched when a thread gets its
+        descriptor, so that its destructor runs when the thread exits */
+    friend struct ThreadExitHook;
+    struct ThreadExitHook {
+        ~ThreadExitHook();
+
+        bool    registered  {false};
+    }; // struct ThreadExitHook
+
 public:
     /* Constructor */
     Melloc();
@@ -227,20 +572,433 @@ public:
     [[nodiscard]]
     static void* allocate(std::size_t n);
 
+    /*  Allocate with a lifetime hint. Long-lived objects come from slabs of
+        their own and skip the thread and per-CPU caches, so every allocation
+        and free of one takes its bin lock. Short is the same as allocate(n) */
+    [[nodiscard]]
+    static void* allocate(std::size_t n, Lifetime lifetime);
+
+    /*  Allocate n bytes of zeroed memory, like calloc. Memory fresh from the
+        kernel is not cleared again */
+    [[nodiscard]]
+    static void* allocateZeroed(std::size_t n);
+
     /* Free memory */
     static void deallocate(void* ptr) noexcept;
 
+    /*  Allocate count objects of the same size into out, resolving the size
+        class once and taking mutBin at most once. If a no-syscall thread is
+        refused a slab the batch comes up short, and the rest of out is
+        nullptr */
+    static void allocateBatch(std::size_t n, std::size_t count, void** out);
+
+    /*  Free count objects, skipping nullptrs, so a short batch from
+        allocateBatch() can be passed back as is. ptrs is sorted in place so
+        that objects from the same slab are freed together */
+    static void deallocateBatch(void** ptrs, std::size_t count) noexcept;
+
+    /*  Bytes the caller may use at ptr, which can be more than it asked for
+        since requests are rounded up to their size class. 0 for nullptr or a
+        pointer melloc did not hand out */
+    static std::size_t usableSize(void* ptr) noexcept;
+
+    /*  Bytes allocate(n) would actually give, without allocating */
+    static std::size_t goodSize(std::size_t n) noexcept;
+
+    /*  Pointer and usable size of an allocation, like std::allocation_result */
+    struct AllocationResult {
+        void*           ptr;
+        std::size_t     count;
+    };
+
+    /*  Allocate at least n bytes and report how many the caller got, like
+        std::allocator::allocate_at_least, so growable buffers can use the
+        whole size class */
+    [[nodiscard]]
+    static AllocationResult allocateAtLeast(std::size_t n);
+
+    /*  Charges the calling thread's allocations and frees to a tag until it
+        goes out of scope. Scopes nest */
+    class TagScope {
+    public:
+        explicit TagScope(Tag tag) noexcept;
+
+        TagScope(const TagScope& other) = delete;
+
+        ~TagScope();
+
+    private:
+        Tag     previous;
+    }; // class TagScope
+
+    /*  Tag the calling thread's allocations are charged to right now */
+    static inline Tag currentTag() noexcept {
+        return threadTag;
+    }
+
+    /*  Allocate and charge it to tag, whatever the current scope */
+    [[nodiscard]]
+    static void* allocate(std::size_t n, Tag tag);
+
+    /*  Free with the size asked for at allocation, like std::allocator.
+        Charged to the current tag without looking the size up. A plain
+        deallocate() under a tag has to find the size class first */
+    static void deallocate(void* ptr, std::size_t n) noexcept;
+
+    /*  Sized free charged to tag */
+    static void deallocate(void* ptr, std::size_t n, Tag tag) noexcept;
+
+    /*  Create a cache that is not tied to a thread, for a task or fiber that
+        moves between threads to carry along, like jemalloc's tcache.create.
+        Only one thread may use a cache at a time. It has no purge timer, so
+        it keeps its chunks until flushed, destroyed or asked to by reclaim() */
+    static CacheId createCache();
+
+    /*  Give every chunk in cache back to its bins */
+    static void flushCache(CacheId cache) noexcept;
+
+    /*  Flush cache and free it. The handle may be reused */
+    static void destroyCache(CacheId cache) noexcept;
+
+    /*  Allocate through cache instead of the calling thread's cache */
+    [[nodiscard]]
+    static void* allocate(std::size_t n, CacheId cache);
+
+    /*  Free into cache. Chunks of another arena, large objects and long-lived
+        objects are freed as by deallocate(ptr) */
+    static void deallocate(void* ptr, CacheId cache) noexcept;
+
+    /*  Live bytes (by size class) and objects charged to one tag. Frees are
+        charged to the tag in effect when they happen, so a tag's live counts
+        only balance if its objects are freed under it too */
+    struct TagStats {
+        std::int64_t    liveBytes       {0};
+        std::int64_t    liveObjects     {0};
+        std::uint64_t   allocations     {0};
+        std::uint64_t   deallocations   {0};
+    };
+
+    /*  Counters of every tag, summed over all threads. Each thread counts in
+        its own counters, so this is the only place that touches them all */
+    static std::array<TagStats, MAX_TAGS> getTagStats() noexcept;
+
+    /*  How a bin picks the chunk to allocate next. AddressOrdered takes the
+        lowest free address in the bin. FullestFirst takes from the fullest slab
+        that still has room and only falls back to empty slabs after that, so
+        that long-lived objects pack into few slabs and empty ones can be
+        released */
+    enum class SlabPolicy {
+        AddressOrdered,
+        FullestFirst
+    };
+
+    static void setSlabPolicy(SlabPolicy policy) noexcept;
+
+    /*  Unmap every slab with no live chunks. Returns the number of bytes
+        released */
+    static std::size_t releaseEmptySlabs() noexcept;
+
+    /*  Flush every thread, explicit and per-CPU cache and halve their
+        capacities, drop pooled descriptors of exited threads, and unmap
+        empty slabs. Returns the number of slab bytes released. Threads in
+        no-syscall mode flush when they leave it instead */
+    static std::size_t reclaim() noexcept;
+
+    /*  What made the pressure watcher reclaim */
+    enum class PressureSource {
+        Psi,            /* memory stall over the PSI threshold */
+        CgroupHigh,     /* cgroup went over memory.high */
+        SoftLimit       /* memory.current over PressureWatch::softLimit */
+    };
+
+    struct PressureEvent {
+        PressureSource  source;
+        std::size_t     current     {0};    /* memory.current, 0 if unknown */
+        std::size_t     released    {0};    /* bytes reclaim() unmapped */
+    };
+
+    /*  Called on the watcher thread after each reclaim */
+    using PressureCallback = void (*)(const PressureEvent& event, void* arg);
+
+    /*  Where the pressure watcher looks. A file that is not on procfs (eg. a
+        fake one in a test) can't take a PSI trigger and is read every pollMs
+        instead, taking its "some avg10" as the stall share */
+    struct PressureWatch {
+        const char*         psiFile     {"/proc/pressure/memory"};  /* nullptr: off */
+        std::size_t         stallUs     {100000};   /* PSI "some" stall ... */
+        std::size_t         windowUs    {1000000};  /* ... per window */
+        const char*         cgroupDir   {nullptr};  /* nullptr: the process's own */
+        std::size_t         softLimit   {0};        /* bytes, 0: off */
+        std::size_t         pollMs      {1000};
+        PressureCallback    callback    {nullptr};
+        void*               callbackArg {nullptr};
+    };
+
+    /*  Start a thread that calls reclaim() whenever the watched files report
+        memory pressure. Returns false if already running or nothing could be
+        watched */
+    static bool startPressureWatch(const PressureWatch& watch);
+
+    static void stopPressureWatch() noexcept;
+
+    /*  Make sure the calling thread's arena has count free chunks of n bytes,
+        in slabs that are faulted in (and mlock'd with lockPages) and are
+        never unmapped. Meant for warmup before no-syscall mode. Returns false
+        if n is a large size, which has no slabs, or if mlock failed */
+    static bool reserve(std::size_t n, std::size_t count, bool lockPages = false);
+
+    /*  Kernel calls the calling thread made, or would have made, in
+        no-syscall mode */
+    struct SyscallReport {
+        std::size_t     mmaps       {0};
+        std::size_t     munmaps     {0};
+        std::size_t     other       {0};    /* eg. a purge timer created */
+        std::size_t     failed      {0};    /* allocations that returned nullptr */
+    };
+
+    /*  Until leaveNoSyscall(), the calling thread's purge timer is stopped,
+        purges it is asked for are held off, and every mmap or munmap it
+        makes is counted. With failAllocations, an allocation that would
+        need a mmap returns nullptr instead. Metadata nodes still come from
+        the system allocator, so this can't rule out its brk/mmap calls */
+    static void enterNoSyscall(bool failAllocations = false);
+
+    static SyscallReport leaveNoSyscall();
+
+    /*  Memory held for one Lifetime. residentBytes are the pages of its slabs
+        and large objects that are faulted in */
+    struct LifetimeStats {
+        std::size_t     slabs           {0};
+        std::size_t     slabBytes       {0};
+        std::size_t     freeSlabBytes   {0};
+        std::size_t     largeObjects    {0};
+        std::size_t     largeBytes      {0};
+        std::size_t     residentBytes   {0};
+    };
+
+    /*  Snapshot of memory held by all arenas. Chunks sitting in thread caches
+        count as in use */
+    struct Stats {
+        std::size_t     slabs           {0};
+        std::size_t     emptySlabs      {0};
+        std::size_t     slabBytes       {0};
+        std::size_t     freeSlabBytes   {0};
+        std::size_t     largeObjects    {0};
+        std::size_t     largeBytes      {0};
+        std::array<LifetimeStats, numLifetimes>    byLifetime {};  /* by Lifetime */
+        std::array<TagStats, MAX_TAGS>              byTag      {};  /* by Tag */
+    };
+
+    static Stats getStats() noexcept;
+
+    using ThreadCacheStats = std::array<CacheBinStats, smallSizeClasses.size()>;
+
+    /*  Counters and current capacities of the calling thread's cache */
+    static ThreadCacheStats getThreadCacheStats() noexcept;
+
+    /*  Lock counters of mutMelloc, and of mutArena and each size class's
+        mutBin summed over all arenas. All zero unless built with
+        MELLOC_LOCK_STATS */
+    struct LockReport {
+        LockStats                                           melloc;
+        LockStats                                           arenas;
+        std::array<LockStats, smallSizeClasses.size()>      bins;
+    };
+
+    static LockReport getLockStats() noexcept;
+
+    static void resetLockStats() noexcept;
+
+    /*  Pause or resume lock counting at runtime */
+    static void setLockStats(bool enabled) noexcept;
+
+    /*  Override tunables with key:value pairs, see melloc_conf.h. Only works
+        before the first allocation; MELLOC_CONF is applied on top. Returns
+        false if too late or if conf had a bad pair */
+    static bool configure(const char* conf) noexcept;
+
+    /*  Settings in effect */
+    static const MellocConfig& getConfig() noexcept;
+
+    /*  Create a private arena for region-style allocation. Its memory is only
+        handed out through allocateIn() and is never thread cached */
+    [[nodiscard]]
+    static std::size_t createArena();
+
+    /* Allocate memory from a private arena */
+    [[nodiscard]]
+    static void* allocateIn(std::size_t arena, std::size_t n);
+
+    /* Free a single object back into its private arena */
+    static void deallocateIn(std::size_t arena, void* ptr) noexcept;
+
+    /*  Free everything allocated from a private arena at once. With retain set,
+        slabs stay mapped and are reused by the next allocations */
+    static void resetArena(std::size_t arena, bool retain = false) noexcept;
+
+    /* Free everything in a private arena and release the arena itself */
+    static void destroyArena(std::size_t arena) noexcept;
+
+    /*  The mmap-based hooks every arena starts with, eg. to wrap in a test
+        double */
+    static ExtentHooks defaultExtentHooks() noexcept;
+
+    /*  Get the pages of an arena, shared or private, from hooks. Only
+        possible while the arena holds no extents, so it returns false once
+        the arena has allocated */
+    static bool setExtentHooks(std::size_t arena, const ExtentHooks& hooks);
+
+    static ExtentHooks getExtentHooks(std::size_t arena);
+
 private:
     /* Assign arena */
     [[nodiscard]]
     static std::size_t getArena() noexcept;
 
-    /*  return the bin index corresponding to a particular size. */
-    static std::size_t getBinIdx(std::size_t sz) noexcept;
+    /*  Apply MELLOC_CONF and create the shared arenas, once, on the first
+        allocation. Caller holds no lock on mutMelloc */
+    static inline void ensureInit() {
+        if (!initialized.load(std::memory_order_acquire)) {
+            initOnce();
+        }
+    }
+
+    static void initOnce();
+
+    /*  Look up a live explicit cache. Caller holds mutMelloc */
+    static ThreadDescriptor& getExplicitCache(CacheId cache) noexcept;
+
+    /*  Free without charging any tag */
+    static void deallocateUncharged(void* ptr) noexcept;
+
+    /*  Count allocations or frees of count objects totalling bytes against
+        tag, in the calling thread's counters */
+    static void tagAllocated(Tag tag, std::size_t bytes, std::size_t count) noexcept;
+
+    static void tagFreed(Tag tag, std::size_t bytes, std::size_t count) noexcept;
+
+    /* Construct the arenas shared by all threads. Caller holds mutMelloc */
+    static void initArenas();
+
+    /*  Reserve the address space of every arena's region */
+    static void reserveHeap() noexcept;
+
+    /*  Arena whose region holds ptr, or MAX_ARENAS if ptr lies outside them */
+    static inline std::size_t regionArena(void* ptr) noexcept {
+        std::uintptr_t offset = reinterpret_cast<std::uintptr_t>(ptr) - heapBase;
+        return heapBase && offset < MAX_ARENAS * ARENA_REGION_SIZE
+            ? offset >> ARENA_REGION_SHIFT
+            : MAX_ARENAS;
+    }
+
+    /* Look up a live private arena */
+    static Arena& getPrivateArena(std::size_t arena) noexcept;
+
+    static const Topology& getTopology() noexcept;
+
+    /* NUMA node of the cpu the calling thread is running on */
+    static std::size_t getCurrentNode() noexcept;
+
+    /* Place fresh pages on a NUMA node before they are first touched */
+    static void bindToNode(void* addr, std::size_t len, std::size_t node) noexcept;
+
+    /*  return the bin index corresponding to a particular small size. */
+    static inline std::size_t getBinIdx(std::size_t sz) noexcept {
+        assert(!isLargeSize(sz));
+        return sizeClassLookup[sizeClassLookupIdx(sz)];
+    }
 
     /*  round up to nearest small or large size class. */
     static std::size_t roundup(std::size_t sz) noexcept;
 
+    /*  Descriptor of the calling thread, creating one on its first allocation.
+        readLock is held on mutMelloc on entry and on return */
+    static ThreadDescriptorWrapper& getThreadDescriptor(
+        std::shared_lock<MellocSharedMutex>& readLock);
+
+    /*  Descriptor of the calling thread, or threadDescriptors.end() if it has
+        none. With MELLOC_SINGLE_THREADED the only descriptor is the caller's,
+        so the id is not hashed */
+    static inline ThreadDescriptorMap::iterator findThreadDescriptor() noexcept {
+#if MELLOC_SINGLE_THREADED
+        return threadDescriptors.begin();
+#else
+        return threadDescriptors.find(std::this_thread::get_id());
+#endif // MELLOC_SINGLE_THREADED
+    }
+
+    /*  Arena the calling thread allocates from: its CPU's when it uses the
+        per-CPU caches, else its descriptor's. Caller holds readLock */
+    static std::size_t callerArena(std::shared_lock<MellocSharedMutex>& readLock);
+
+    /*  Descriptor of the calling thread, taken from the free pool or created
+        on its first allocation. Caller holds no lock on mutMelloc */
+    static ThreadDescriptorMap::iterator acquireThreadDescriptor();
+
+    /*  Park the calling thread's descriptor in the free pool */
+    static void releaseThreadDescriptor() noexcept;
+
+    /*  Exit after a fatal error. exit() runs the calling thread's thread_local
+        destructors first, while the failing call may still hold mutMelloc or
+        an arena lock, so ThreadExitHook is told to leave the descriptor be */
+    [[noreturn]] static void fatal() noexcept;
+
+#if MELLOC_PERCPU_CACHE
+    /*  True if the calling thread can use the per-CPU caches */
+    static bool perCpuUsable() noexcept;
+
+    /*  Allocate through the current CPU's cache and arena. Returns nullptr if
+        the calling thread can't use the per-CPU caches. Caller holds a read
+        lock on mutMelloc */
+    static void* allocatePerCpu(std::size_t sz, bool* isZeroed = nullptr);
+
+    /*  Free a small chunk of the current CPU's arena into the CPU's cache.
+        Returns false if ptr is not one, or per-CPU caches are unusable.
+        Caller holds a read lock on mutMelloc */
+    static bool deallocatePerCpu(void* ptr) noexcept;
+
+    /*  Shared arena serving a CPU, on that CPU's NUMA node */
+    static std::size_t getCpuArena(std::size_t cpu) noexcept;
+
+    /*  Cache of a CPU, mapped on first use */
+    static CpuCache* getCpuCache(std::size_t cpu) noexcept;
+
+    /*  Give every chunk in the per-CPU caches back to its bin. Caller holds
+        the write lock on mutMelloc, so no thread is inside an rseq section */
+    static void flushCpuCaches() noexcept;
+#endif // MELLOC_PERCPU_CACHE
+
+    /*  No-syscall mode of a thread */
+    struct NoSyscallState {
+        bool            active          {false};
+        bool            failAllocations {false};
+        SyscallReport   report;
+    };
+
+    /*  Account for a kernel call the calling thread is about to make. Returns
+        false if it is a mmap and the thread asked for those to fail */
+    static inline bool syscallAllowed(std::size_t SyscallReport::* counter) noexcept {
+        if (!noSyscall.active) {
+            return true;
+        }
+        ++(noSyscall.report.*counter);
+        if (noSyscall.failAllocations && counter == &SyscallReport::mmaps) {
+            ++noSyscall.report.failed;
+            return false;
+        }
+        return true;
+    }
+
+    /*  A null result from the per-CPU path means the thread can't use the
+        per-CPU caches, unless it is in no-syscall mode and was refused */
+    static inline bool perCpuRefused() noexcept {
+#if MELLOC_PERCPU_CACHE
+        return noSyscall.active && perCpuUsable();
+#else
+        return false;
+#endif // MELLOC_PERCPU_CACHE
+    }
+
     void decay() noexcept;
 
     void init() noexcept;
@@ -251,11 +1009,27 @@ public:
     static std::mutex                                           mutPrint;
 private:
 #endif // NDEBUG
-    static std::shared_mutex                                    mutMelloc;
-    static std::array<Arena, NUM_ARENAS>                        arenas;
-    static std::unordered_map<std::thread::id,
-                              ThreadDescriptorWrapper,
-                              ThreadDescriptorWrapper::hash>    threadDescriptors;
+    /*  Every allocation takes mutMelloc, so it gets a line of its own rather
+        than dragging the read-mostly members along with it */
+    alignas(CACHE_LINE_SIZE) static MellocSharedMutex           mutMelloc;
+    alignas(CACHE_LINE_SIZE) static std::array<std::unique_ptr<Arena>, MAX_ARENAS>
+                                                                arenas;
+    alignas(CACHE_LINE_SIZE) static std::size_t                 numArenas;
+    static std::uintptr_t                                       heapBase;
+    static MellocAtomic<std::size_t>                            nextArena;
+    static MellocAtomic<bool>                                   initialized;
+    static MellocAtomic<bool>                                   exiting;
+    static MellocAtomic<SlabPolicy>                             slabPolicy;
+    static ThreadDescriptorMap                                  threadDescriptors;
+    static std::vector<ThreadDescriptorMap::node_type>          freeThreadDescriptors;
+    /*  Explicit caches by CacheId, empty where destroyed */
+    static std::vector<std::unique_ptr<ThreadDescriptor>>       explicitCaches;
+    static thread_local ThreadExitHook                          threadExitHook;
+    static thread_local NoSyscallState                          noSyscall;
+    static thread_local Tag                                     threadTag;
+#if MELLOC_PERCPU_CACHE
+    static std::array<std::atomic<CpuCache*>, MAX_CPUS>         cpuCaches;
+#endif // MELLOC_PERCPU_CACHE
     bool                                                        globalInit {false};
 };
 
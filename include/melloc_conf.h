@@ -0,0 +1,124 @@
+/**
+ * @file melloc_conf.h
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Runtime tunables
+ * @version 1.0
+ * @date 2023-11-24
+ *
+ *
+ * The macros in melloc_defs.h are only the defaults. They can be overridden
+ * without rebuilding through Melloc::configure() before the first allocation,
+ * and then through the MELLOC_CONF environment variable, which wins. Both take
+ * comma separated key:value pairs, with an optional k/m/g suffix on values:
+ *
+ *   MELLOC_CONF="narenas:4,tcache_max:256,tcache_budget:1m,purge_ms:500"
+ *
+ *   narenas                 shared arenas (rounded up to a multiple of nodes)
+ *   tcache_min              fewest items a cache bin holds room for
+ *   tcache_max              most items a cache bin holds room for
+ *   tcache_default_bytes    bytes' worth of objects a cache bin starts with
+ *   tcache_class_bytes      bytes' worth of objects a cache bin may grow to
+ *   tcache_budget           bytes of cache capacity per thread, at least
+ *                           what the cache bins start with
+ *   tcache_grow_events      misses or overflows before a cache bin grows
+ *   slab_min_objects        objects per slab for classes above a page / this
+ *   purge_ms                interval of the thread cache purge timer
+ *   decay_ticks             idle purge ticks before a cache bin shrinks
+ *
+ * Parsing doesn't allocate, so it is safe during static initialization.
+ *
+ */
+
+#ifndef UTIL_MELLOC_CONF_H
+#define UTIL_MELLOC_CONF_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+
+#include "melloc_defs.h"
+
+
+struct MellocConfig {
+    constexpr MellocConfig() {
+        finalize();
+    }
+
+    /*  Clamp the tunables into range and derive the per size class tables */
+    constexpr void finalize() noexcept {
+        narenas = MELLOC_SINGLE_THREADED ? 1 : std::clamp<std::size_t>(narenas, 1, MAX_ARENAS);
+        tcacheMax = std::clamp<std::size_t>(tcacheMax, 1, THREAD_CACHE_LIMIT);
+        tcacheMin = std::clamp<std::size_t>(tcacheMin, 1, tcacheMax);
+        tcacheGrowEvents = std::max<std::size_t>(tcacheGrowEvents, 1);
+        slabMinObjects = std::clamp<std::size_t>(slabMinObjects, 1, MMAP_MAX_OBJECTS_TAKEN);
+        purgeMs = std::max<std::size_t>(purgeMs, 1);
+        decayTicks = std::max<std::size_t>(decayTicks, 1);
+
+        /*  A budget beyond every bin at its maximum would never be reached */
+        std::size_t tcacheMaxTotal = 0;
+        tcacheOffsets[0] = 0;
+        for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+            std::size_t sizeClass = smallSizeClasses[i];
+            tcacheMaxCapacity[i] = std::clamp(tcacheClassBytes / sizeClass, tcacheMin, tcacheMax);
+            tcacheOffsets[i + 1] = tcacheOffsets[i] + tcacheMaxCapacity[i];
+            tcacheMaxTotal += tcacheMaxCapacity[i] * sizeClass;
+        }
+        tcacheBudget = std::min(tcacheBudget, tcacheMaxTotal);
+
+        /*  The starting capacities have to fit the budget, or no bin could
+            ever grow. Shrink them towards tcacheMin until they do, and if even
+            that is too much, the budget gives way */
+        for (;;) {
+            for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+                tcacheDefaultCapacity[i] = std::clamp(tcacheDefaultBytes / smallSizeClasses[i], tcacheMin,
+                                                      std::max(tcacheMaxCapacity[i] / 2, tcacheMin));
+            }
+            if (tcacheDefaultTotal() <= tcacheBudget || tcacheDefaultBytes == 0) {
+                break;
+            }
+            tcacheDefaultBytes /= 2;
+        }
+        tcacheBudget = std::max(tcacheBudget, tcacheDefaultTotal());
+    }
+
+    /*  Bytes a thread's cache bins hold room for before any of them grows */
+    constexpr std::size_t tcacheDefaultTotal() const noexcept {
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+            total += tcacheDefaultCapacity[i] * smallSizeClasses[i];
+        }
+        return total;
+    }
+
+    std::size_t     narenas             {NUM_ARENAS};
+    std::size_t     tcacheMin           {THREAD_CACHE_MIN};
+    std::size_t     tcacheMax           {THREAD_CACHE_MAX};
+    std::size_t     tcacheDefaultBytes  {THREAD_CACHE_DEFAULT_BYTES};
+    std::size_t     tcacheClassBytes    {THREAD_CACHE_CLASS_BYTES};
+    std::size_t     tcacheBudget        {THREAD_CACHE_BUDGET};
+    std::size_t     tcacheGrowEvents    {THREAD_CACHE_GROW_EVENTS};
+    std::size_t     slabMinObjects      {MMAP_MIN_OBJECTS_TAKEN};
+    std::size_t     purgeMs             {THREAD_PURGE_TIMER * 1000};
+    std::size_t     decayTicks          {1};
+
+    /*  Derived by finalize(). All cache bins of a thread share one array of
+        tcacheOffsets.back() slots, bin i starts at tcacheOffsets[i] */
+    std::array<std::size_t, smallSizeClasses.size()>        tcacheMaxCapacity       {0};
+    std::array<std::size_t, smallSizeClasses.size()>        tcacheDefaultCapacity   {0};
+    std::array<std::size_t, smallSizeClasses.size() + 1>    tcacheOffsets           {0};
+};
+
+static_assert(MellocConfig{}.tcacheDefaultTotal() < THREAD_CACHE_BUDGET,
+              "THREAD_CACHE_BUDGET leaves the thread cache no room to grow");
+
+/*  Settings in effect. Only written before the arenas are created */
+inline MellocConfig mellocConf;
+
+/*  Apply key:value pairs from conf onto config. Returns false if any pair was
+    malformed or unknown; the valid ones are still applied */
+bool parseMellocConf(MellocConfig& config, const char* conf) noexcept;
+
+
+
+#endif // UTIL_MELLOC_CONF_H
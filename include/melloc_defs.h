@@ -16,8 +16,11 @@
 #ifndef UTIL_MELLOC_DEFS_H
 #define UTIL_MELLOC_DEFS_H
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #ifndef NDEBUG
 #include <iostream>
 #endif // NDEBUG
@@ -27,57 +30,228 @@
 #define PAGE_SIZE               (4096U)
 
 /*   Corresponding bitmask for getting the page number to above page size */
-#define PAGE_MASK               (0xFFFFF000)
+#define PAGE_MASK               (~static_cast<std::size_t>(PAGE_SIZE - 1))
 
-/*   Number of arenas. Jemalloc uses 4 x number of CPU cores. Stubbed for now */
+/*   Metadata written by different threads is kept on separate cache lines, and
+     slab colors (the offset of a slab's first chunk) step by one line */
+#define CACHE_LINE_SIZE         (64U)
+
+/*   The tunables below marked (MELLOC_CONF) are defaults that can be changed at
+     runtime, see melloc_conf.h */
+
+/*   Number of arenas. Jemalloc uses 4 x number of CPU cores. Stubbed for now
+     (MELLOC_CONF) */
 #define NUM_ARENAS              (1)
 
- /*  Number of max cached items per size class per thread. Larger thread cache 
-     will have less peak lock contention, but more peak metadata memory */
-#define THREAD_CACHE_SIZE       (static_cast<std::size_t>(16))
+/*   Upper bounds on the NUMA topology we track. Nodes past MAX_NUMA_NODES are
+     folded onto lower ones, CPUs past MAX_CPUS are treated as node 0 */
+#define MAX_NUMA_NODES          (16)
+#define MAX_CPUS                (1024)
+
+/*   Set to 1 to bind slabs strictly to their arena's node (MPOL_BIND). The
+     default only prefers the node, so the kernel may fall back to another node
+     rather than OOM when the local one is exhausted */
+#define NUMA_STRICT_BIND        (0)
+
+/*   Set to 1 (eg. cmake -DMELLOC_SINGLE_THREADED=ON) for programs that only
+     ever call melloc from one thread. The allocator's locks and atomics compile
+     away, there is a single arena, and the calling thread's descriptor is found
+     without hashing its id. Lock stats, per-CPU caches and the pressure watcher
+     are not available */
+#ifndef MELLOC_SINGLE_THREADED
+#define MELLOC_SINGLE_THREADED  (0)
+#endif
+
+/*   Set to 1 (eg. cmake -DMELLOC_LOCK_STATS=ON) to count acquisitions,
+     contention and wait/hold times on the allocator's locks, see lock_stats.h */
+#ifndef MELLOC_LOCK_STATS
+#define MELLOC_LOCK_STATS       (0)
+#endif
+
+/*   Set to 1 (eg. cmake -DMELLOC_PERCPU_CACHE=ON) to cache small objects per
+     CPU with restartable sequences instead of per thread. Needs Linux on x86-64
+     and a glibc that registers rseq (2.35+); threads where rseq is not
+     registered keep using the thread cache */
+#ifndef MELLOC_PERCPU_CACHE
+#define MELLOC_PERCPU_CACHE     (0)
+#endif
+#if MELLOC_PERCPU_CACHE && !(defined(__linux__) && defined(__x86_64__))
+#undef MELLOC_PERCPU_CACHE
+#define MELLOC_PERCPU_CACHE     (0)
+#endif
+#if MELLOC_SINGLE_THREADED
+#undef MELLOC_LOCK_STATS
+#define MELLOC_LOCK_STATS       (0)
+#undef MELLOC_PERCPU_CACHE
+#define MELLOC_PERCPU_CACHE     (0)
+#endif
+
+/*   Records buffered per thread before they are written to the trace file */
+#define TRACE_BUFFER_RECORDS    (4096)
+
+/*   Number of allocation tags, see Melloc::TagScope. Tag 0 is untagged */
+#define MAX_TAGS                (64)
+
+/*   Maximum number of arenas alive at once, including private arenas handed
+     out by Melloc::createArena() */
+#define MAX_ARENAS              (64)
+
+/*   Every arena slot gets a region of ARENA_REGION_SIZE bytes of address space,
+     aligned to its size, reserved once for all slots. Slabs and large objects
+     are carved out of the arena's region, which is committed ARENA_COMMIT_SIZE
+     at a time, and the arena owning an address is found with a shift. An arena
+     that fills its region maps further slabs and large objects on their own */
+#define ARENA_REGION_SHIFT      (32)
+#define ARENA_REGION_SIZE       (static_cast<std::size_t>(1) << ARENA_REGION_SHIFT)
+#define ARENA_COMMIT_SIZE       (static_cast<std::size_t>(2) << 20)
+
+ /*  Bounds on the number of cached items per size class per thread. Larger
+     thread cache will have less peak lock contention, but more peak metadata
+     memory. Each class starts at THREAD_CACHE_DEFAULT_BYTES worth of objects,
+     but at most half its maximum so it always has room to grow. It grows by
+     doubling after THREAD_CACHE_GROW_EVENTS misses or overflows, and halves when
+     idle for a purge tick. A class never caches more than
+     THREAD_CACHE_CLASS_BYTES, and a thread's capacities never add up to more
+     than THREAD_CACHE_BUDGET bytes (MELLOC_CONF), which must leave room above
+     what the starting capacities take. THREAD_CACHE_LIMIT is the hard upper
+     bound on THREAD_CACHE_MAX */
+#define THREAD_CACHE_LIMIT          (static_cast<std::size_t>(1024))
+#define THREAD_CACHE_MIN            (static_cast<std::size_t>(4))
+#define THREAD_CACHE_MAX            (static_cast<std::size_t>(128))
+#define THREAD_CACHE_DEFAULT_BYTES  (static_cast<std::size_t>(4 * 1024))
+#define THREAD_CACHE_CLASS_BYTES    (static_cast<std::size_t>(32 * 1024))
+#define THREAD_CACHE_BUDGET         (static_cast<std::size_t>(1024 * 1024))
+#define THREAD_CACHE_GROW_EVENTS    (4)
 
 /*   Minimum number of objects requested per size class when a bin runs out of
-     memory. */
+     memory (MELLOC_CONF). MMAP_MAX_OBJECTS_TAKEN is the hard upper bound on it,
+     which keeps the biggest class's slabs to a few MB */
 #define MMAP_MIN_OBJECTS_TAKEN  (32)
+#define MMAP_MAX_OBJECTS_TAKEN  (512)
 
-/*   Number of seconds between every call for per-thread garbage collector */
+/*   Number of seconds between every call for per-thread garbage collector
+     (MELLOC_CONF, in ms) */
 #define THREAD_PURGE_TIMER      (2)
 
+/*   Blocks at least this big are cleared with non-temporal stores, which skip
+     the cache instead of evicting everything else from it */
+#define NONTEMPORAL_ZERO_MIN    (256 * 1024)
+
+
+/*   Small size classes are generated at compile time from a spec, like jemalloc:
+     one tiny class, then multiples of SIZE_CLASS_QUANTUM up to the first group
+     base (QUANTUM * GROUPS), after which every doubling of the size is split into
+     SIZE_CLASS_GROUPS evenly spaced classes. With 8 groups the rounding waste
+     is below 1/8 of the request from the first group on. Anything above
+     MAX_SMALL_SIZE_CLASS is a large object */
+#define TINY_SIZE_CLASS         (8)
+#define SIZE_CLASS_QUANTUM      (16)
+#define SIZE_CLASS_GROUPS       (8)
+#define MAX_SMALL_SIZE_CLASS    (14336)
+
+/*   Granularity of the size -> bin lookup table. Every class is a multiple */
+#define SIZE_CLASS_LOOKUP_SHIFT (3)
+
 
 static_assert(PAGE_SIZE > 0);
-static_assert(THREAD_CACHE_SIZE > 0);
-static_assert(PAGE_SIZE > 0);
+static_assert(PAGE_SIZE % CACHE_LINE_SIZE == 0);
+static_assert(THREAD_CACHE_MIN > 0 && THREAD_CACHE_MIN <= THREAD_CACHE_MAX);
+static_assert(THREAD_CACHE_MAX <= THREAD_CACHE_LIMIT);
+static_assert(MMAP_MIN_OBJECTS_TAKEN > 0 && MMAP_MIN_OBJECTS_TAKEN <= MMAP_MAX_OBJECTS_TAKEN);
+static_assert(NUM_ARENAS <= MAX_ARENAS);
+static_assert(MAX_NUMA_NODES > 0 && MAX_NUMA_NODES < MAX_ARENAS);
+static_assert(ARENA_COMMIT_SIZE % PAGE_SIZE == 0 && ARENA_REGION_SIZE % ARENA_COMMIT_SIZE == 0);
+static_assert(SIZE_CLASS_GROUPS > 0 && (SIZE_CLASS_GROUPS & (SIZE_CLASS_GROUPS - 1)) == 0);
+
+/*  Walks the size class spec, calling fn on every class in increasing order */
+template <typename Fn>
+constexpr void forEachSizeClass(Fn fn) {
+    fn(static_cast<std::size_t>(TINY_SIZE_CLASS));
+    std::size_t groupBase = SIZE_CLASS_QUANTUM * SIZE_CLASS_GROUPS;
+    for (std::size_t sz = SIZE_CLASS_QUANTUM; sz <= groupBase; sz += SIZE_CLASS_QUANTUM) {
+        fn(sz);
+    }
+    for (std::size_t base = groupBase; ; base <<= 1) {
+        std::size_t spacing = base / SIZE_CLASS_GROUPS;
+        for (std::size_t i = 1; i <= SIZE_CLASS_GROUPS; ++i) {
+            if (base + i * spacing > MAX_SMALL_SIZE_CLASS) {
+                return;
+            }
+            fn(base + i * spacing);
+        }
+    }
+}
+
+constexpr std::size_t countSizeClasses() {
+    std::size_t n = 0;
+    forEachSizeClass([&](std::size_t) { ++n; });
+    return n;
+}
+
+template <std::size_t N>
+constexpr std::array<std::size_t, N> makeSizeClasses() {
+    std::array<std::size_t, N> out {0};
+    std::size_t i = 0;
+    forEachSizeClass([&](std::size_t sz) { out[i++] = sz; });
+    return out;
+}
+
+static constexpr std::array<std::size_t, countSizeClasses()> smallSizeClasses =
+    makeSizeClasses<countSizeClasses()>();
+
+/*  sizeClassLookup[sizeClassLookupIdx(sz)] is the bin index of the smallest
+    class that fits sz, for every small sz */
+constexpr std::size_t sizeClassLookupIdx(std::size_t sz) noexcept {
+    return (sz + (1 << SIZE_CLASS_LOOKUP_SHIFT) - 1) >> SIZE_CLASS_LOOKUP_SHIFT;
+}
+
+template <std::size_t N>
+constexpr std::array<std::uint8_t, N> makeSizeClassLookup() {
+    std::array<std::uint8_t, N> out {0};
+    std::size_t bin = 0;
+    for (std::size_t i = 0; i < N; ++i) {
+        while (smallSizeClasses[bin] < (i << SIZE_CLASS_LOOKUP_SHIFT)) {
+            ++bin;
+        }
+        out[i] = static_cast<std::uint8_t>(bin);
+    }
+    return out;
+}
+
+static constexpr std::size_t sizeClassLookupLen =
+    sizeClassLookupIdx(MAX_SMALL_SIZE_CLASS) + 1;
+
+static constexpr std::array<std::uint8_t, sizeClassLookupLen> sizeClassLookup =
+    makeSizeClassLookup<sizeClassLookupLen>();
+
+/*  Checks the generated classes are strictly increasing, land on the lookup
+    granularity, and that every size maps to the smallest class fitting it, so
+    that rounding a class up gives back the class itself */
+constexpr bool verifySizeClasses() {
+    for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+        std::size_t sz = smallSizeClasses[i];
+        if (i > 0 && sz <= smallSizeClasses[i-1]) {
+            return false;
+        }
+        if (sz % (1 << SIZE_CLASS_LOOKUP_SHIFT) != 0) {
+            return false;
+        }
+        if (sizeClassLookup[sizeClassLookupIdx(sz)] != i) {
+            return false;
+        }
+    }
+    for (std::size_t sz = 1; sz <= MAX_SMALL_SIZE_CLASS; ++sz) {
+        std::size_t bin = sizeClassLookup[sizeClassLookupIdx(sz)];
+        if (smallSizeClasses[bin] < sz || (bin > 0 && smallSizeClasses[bin-1] >= sz)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-static constexpr std::array<std::size_t, 28> smallSizeClasses{
-    /* 0*/  8,
-    /* 1*/  16,
-    /* 2*/  32,
-    /* 3*/  48,
-    /* 4*/  64,
-    /* 5*/  80,
-    /* 6*/  96,
-    /* 7*/  112,
-    /* 8*/  128,
-    /* 9*/  192,
-    /* 10*/ 256,
-    /* 11*/ 320,
-    /* 12*/ 384,
-    /* 13*/ 448,
-    /* 14*/ 512,
-    /* 15*/ 768,
-    /* 16*/ 1024,
-    /* 17*/ 1280,
-    /* 18*/ 1536,
-    /* 19*/ 1792,
-    /* 20*/ 2048,
-    /* 21*/ 2304,
-    /* 22*/ 2560,
-    /* 23*/ 2816,
-    /* 24*/ 3072,
-    /* 25*/ 3328,
-    /* 26*/ 3584,
-    /* 27*/ 3840
-};
+static_assert(smallSizeClasses.size() < 256, "bin index must fit sizeClassLookup");
+static_assert(smallSizeClasses.back() == MAX_SMALL_SIZE_CLASS);
+static_assert(verifySizeClasses());
 
 
 #endif // UTIL_MELLOC_DEFS_H
\ No newline at end of file
@@ -0,0 +1,45 @@
+/**
+ * @file melloc_probes.h
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief USDT probes on the allocator slow paths
+ * @version 1.0
+ * @date 2023-11-14
+ *
+ *
+ * Static tracepoints for bpftrace/perf/systemtap, provider "melloc". An
+ * unattached probe is a single nop in the code and some ELF notes, so these
+ * stay in release builds. Without <sys/sdt.h> they compile to nothing.
+ *
+ *   bin_refill          (arena, sizeClass, count)   chunks taken from a bin
+ *   bin_give_back       (arena, sizeClass, count)   chunks returned to a bin
+ *   slab_mmap           (arena, sizeClass, bytes)   new slab mapped
+ *   slab_munmap         (arena, sizeClass, bytes)   empty slab unmapped
+ *   large_mmap          (arena, bytes)              large object mapped
+ *   large_munmap        (arena, bytes)              large object unmapped
+ *   tcache_purge        (arena, count, bytes)       thread cache purge tick
+ *   thread_cache_create (arena, reused)             thread descriptor handed out
+ *   reclaim             (bytes)                     reclaim() released slabs
+ *
+ * eg. bpftrace -e 'usdt:./melloc:melloc:slab_mmap { @[arg1] = count(); }'
+ *
+ */
+
+#ifndef UTIL_MELLOC_PROBES_H
+#define UTIL_MELLOC_PROBES_H
+
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MELLOC_PROBE(name, ...)     STAP_PROBEV(melloc, name, ##__VA_ARGS__)
+#endif
+#endif
+
+#ifndef MELLOC_PROBE
+#define MELLOC_PROBE(name, ...)     do {} while (0)
+#endif
+
+
+
+#endif // UTIL_MELLOC_PROBES_H
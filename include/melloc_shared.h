@@ -0,0 +1,144 @@
+/**
+ * @file melloc_shared.h
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Arenas in shared memory or a file
+ * @version 1.0
+ * @date 2023-12-04
+ *
+ *
+ * A SharedArena allocates out of one shared mapping: a memfd, or a file that
+ * keeps its contents across runs. Everything it needs to know is stored in
+ * the mapping itself as offsets from its start, so every process mapping it
+ * can allocate and free, wherever the mapping lands in its address space.
+ * Objects are handed between processes by offset, see toOffset() and
+ * fromOffset().
+ *
+ * Objects in a SharedArena are never thread cached and must be freed through
+ * the SharedArena, not Melloc::deallocate().
+ *
+ */
+
+#ifndef UTIL_MELLOC_SHARED_H
+#define UTIL_MELLOC_SHARED_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+
+/*  Mapping starts with this, see shared_arena.cpp */
+struct SharedArenaHeader;
+
+#define SHARED_ARENA_MAGIC      "MLCSHARE"
+#define SHARED_ARENA_VERSION    (1U)
+
+class SharedArena {
+public:
+    /*  Offset of an object from the start of the mapping. 0 is never an
+        object, and stands for nullptr */
+    using Offset = std::uint64_t;
+
+    /*  Map the file at path, creating it with size bytes if it does not exist
+        or is empty. An existing file is reopened with its contents and keeps
+        its own size. Returns nullptr if the file can't be mapped or is not a
+        shared arena of this version */
+    static std::unique_ptr<SharedArena> open(const char* path, std::size_t size);
+
+    /*  A fresh arena of size bytes on an anonymous memfd. Other processes
+        get it through fork() or by being passed fd() */
+    static std::unique_ptr<SharedArena> create(std::size_t size);
+
+    /*  Map an arena made by create() or open() in another process. fd is
+        dup'd, the caller keeps its own */
+    static std::unique_ptr<SharedArena> openFd(int fd);
+
+    SharedArena(const SharedArena& other) = delete;
+
+    ~SharedArena();
+
+    /*  Returns nullptr when the mapping is full */
+    [[nodiscard]]
+    void* allocate(std::size_t n);
+
+    void deallocate(void* ptr) noexcept;
+
+    inline Offset toOffset(const void* ptr) const noexcept {
+        return ptr ? static_cast<Offset>(static_cast<const char*>(ptr) - base) : 0;
+    }
+
+    inline void* fromOffset(Offset off) const noexcept {
+        return off ? base + off : nullptr;
+    }
+
+    inline bool owns(const void* ptr) const noexcept {
+        const char* c = static_cast<const char*>(ptr);
+        return c >= base && c < base + len;
+    }
+
+    /*  One offset kept in the header for finding the object graph again after
+        reopening, eg. the root of a tree */
+    void setRoot(Offset off) noexcept;
+
+    Offset getRoot() const noexcept;
+
+    /*  Write the mapping back to its file */
+    bool sync() noexcept;
+
+    inline int fd() const noexcept {
+        return fileFd;
+    }
+
+    inline std::size_t size() const noexcept {
+        return len;
+    }
+
+private:
+    SharedArena(int fd, char* base, std::size_t len);
+
+    /*  Set up the header and page map of a fresh mapping */
+    void format() noexcept;
+
+    /*  Make the header's lock a fresh process-shared robust mutex */
+    void initLock() noexcept;
+
+    /*  Check the header of a mapping made elsewhere */
+    bool validate() const noexcept;
+
+    /*  Map an open fd of at least len bytes, formatting it if fresh */
+    static std::unique_ptr<SharedArena> map(int fd, std::size_t len, bool fresh);
+
+    void lock() noexcept;
+
+    void unlock() noexcept;
+
+    /*  Offset of npages free pages: the first free run that fits, else the
+        top of the data. 0 if there is no room. Caller holds the lock */
+    Offset takePages(std::size_t npages) noexcept;
+
+    /*  Turn npages at off into a free run. Caller holds the lock */
+    void freePages(Offset off, std::size_t npages) noexcept;
+
+    /*  Carve a slab for binIdx and thread its chunks onto the free list.
+        Caller holds the lock */
+    bool refill(std::size_t binIdx) noexcept;
+
+    inline SharedArenaHeader* header() const noexcept {
+        return reinterpret_cast<SharedArenaHeader*>(base);
+    }
+
+    inline std::uint32_t& pageEntry(Offset off) const noexcept;
+
+    inline Offset& link(Offset off) const noexcept {
+        return *reinterpret_cast<Offset*>(base + off);
+    }
+
+    // SharedArena members
+    char*           base    {nullptr};
+    std::size_t     len     {0};
+    int             fileFd  {-1};
+};
+
+
+#endif // UTIL_MELLOC_SHARED_H
@@ -0,0 +1,69 @@
+/**
+ * @file melloc_trace.h
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Allocation trace recording
+ * @version 1.0
+ * @date 2023-11-12
+ *
+ *
+ * Setting MELLOC_TRACE_FILE makes every allocate/deallocate append a
+ * TraceRecord to a per-thread buffer, which is written to that file whenever
+ * it fills and when the thread exits. melloc_replay reads the file back.
+ *
+ */
+
+#ifndef UTIL_MELLOC_TRACE_H
+#define UTIL_MELLOC_TRACE_H
+
+
+#include <cstddef>
+#include <cstdint>
+
+
+/*  Trace file starts with this header, followed by TraceRecords */
+struct TraceHeader {
+    char            magic[8];   /* TRACE_MAGIC */
+    std::uint32_t   version;
+    std::uint32_t   recordSize;
+};
+
+#define TRACE_MAGIC             "MLCTRACE"
+#define TRACE_VERSION           (1U)
+
+enum class TraceOp : std::uint8_t {
+    Allocate,
+    AllocateZeroed,
+    Deallocate
+};
+
+/*  One allocator call. Records from different threads land in the file in
+    flush order, so seq is what puts them back in call order. Allocations take
+    their seq after they return and frees before they start, so a free always
+    sorts after the allocation it frees, even across threads. ptr is the raw
+    address, melloc_replay turns addresses into object ids */
+struct TraceRecord {
+    std::uint64_t   seq;
+    std::uint64_t   timestamp;  /* ns since tracing started */
+    std::uint64_t   ptr;
+    std::uint32_t   size;       /* requested bytes, saturated at 4 GiB */
+    std::uint16_t   thread;     /* order in which threads first recorded */
+    TraceOp         op;
+    std::uint8_t    reserved;
+};
+static_assert(sizeof(TraceRecord) == 32);
+
+/*  Opens MELLOC_TRACE_FILE on first use. False if tracing is off */
+bool traceOpen() noexcept;
+
+inline bool traceEnabled() noexcept {
+    static const bool enabled = traceOpen();
+    return enabled;
+}
+
+/*  Append a record to the calling thread's buffer */
+void traceRecord(TraceOp op, std::size_t size, void* ptr) noexcept;
+
+
+
+#endif // UTIL_MELLOC_TRACE_H
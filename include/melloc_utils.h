@@ -17,10 +17,16 @@
 
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 #ifndef NDEBUG
 #include <cstdio>
 #include <mutex>
 #endif // NDEBUG
+#include "melloc_conf.h"
 #include "melloc_defs.h"
 
 
@@ -47,13 +53,49 @@ inline Page getPage(void* addr) noexcept {
 }
 
 inline bool isLargeSize(std::size_t sz) noexcept {
-    return sz >= PAGE_SIZE;
+    return sz > MAX_SMALL_SIZE_CLASS;
 }
 
 inline bool isOffPage(std::size_t sz) noexcept {
     return !(sz == (sz & PAGE_MASK));
 }
 
+/*  Number of bytes in one slab of a small size class. The smallest classes get
+    a single page, the rest get enough whole pages for slabMinObjects objects */
+inline std::size_t getSlabSize(std::size_t sizeClass) noexcept {
+    if (sizeClass < PAGE_SIZE / mellocConf.slabMinObjects) {
+        return PAGE_SIZE;
+    }
+    std::size_t bytes = mellocConf.slabMinObjects * sizeClass;
+    return (bytes & PAGE_MASK) + PAGE_SIZE * isOffPage(bytes);
+}
+
+/*  Zero n bytes. Big blocks are cleared with non-temporal stores where
+    available, since the caller is unlikely to read all of it back soon */
+inline void zeroMemory(void* ptr, std::size_t n) noexcept {
+#ifdef __SSE2__
+    if (n >= NONTEMPORAL_ZERO_MIN) {
+        char* c = static_cast<char*>(ptr);
+        std::size_t head = (16 - (reinterpret_cast<std::uintptr_t>(c) & 15)) & 15;
+        std::memset(c, 0, head);
+        c += head;
+        n -= head;
+        __m128i zero = _mm_setzero_si128();
+        __m128i* out = reinterpret_cast<__m128i*>(c);
+        for (std::size_t i = 0; i < n / 64; ++i, out += 4) {
+            _mm_stream_si128(out,     zero);
+            _mm_stream_si128(out + 1, zero);
+            _mm_stream_si128(out + 2, zero);
+            _mm_stream_si128(out + 3, zero);
+        }
+        _mm_sfence();
+        std::memset(out, 0, n % 64);
+        return;
+    }
+#endif // __SSE2__
+    std::memset(ptr, 0, n);
+}
+
 /*  Pointer address arithmetic */
 inline void* increment(void* ptr, std::size_t sz) noexcept {
     return static_cast<char*>(ptr) + sz;
@@ -8,138 +8,456 @@
  *
  *
  * An arena can be considered a sub-heap
- * All arenas are initialized when a new virtual address space is created.
+ * The shared arenas are created on the first allocation, once MELLOC_CONF is read.
+ *
+ * Each arena slot owns an aligned region of reserved address space (see
+ * ARENA_REGION_SIZE). Slabs and large objects are extents carved from it:
+ * first fit among extents given back, else bumped off the top, committing the
+ * region with mprotect a few MB at a time. Freed extents are purged with
+ * MADV_DONTNEED and kept, so the region stays a couple of VMAs however many
+ * slabs come and go, and slabs of an arena stay close together.
+ *
+ * Every mmap, mprotect, madvise and munmap of an extent goes through the
+ * arena's ExtentHooks, so a caller can supply the pages instead. Hooks
+ * without commit get no region and map every extent with alloc.
  *                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                        
  */
 
 #include <cassert>
+#include <cstdlib>
 #ifdef __linux__
 #include <sys/mman.h>
 #endif // __linux__
 
 #include "melloc.h"
 #include "melloc_defs.h"
+#include "melloc_probes.h"
 #include "melloc_utils.h"
 
 
-Melloc::Arena::Arena() {
+#ifdef __linux__
+static void* defaultExtentAlloc(std::size_t len, std::size_t /* arena */, void* /* arg */) {
+    void* out = mmap(/* preferred addr  */ nullptr,
+                     /* size            */ len,
+                     /* protect flags   */ PROT_READ | PROT_WRITE,
+                     /* map flags       */ MAP_PRIVATE | MAP_ANONYMOUS,
+                     /* file descriptor */ -1,
+                     /* chunk offset    */ 0);
+    return out == MAP_FAILED ? nullptr : out;
+}
+
+static bool defaultExtentDalloc(void* addr, std::size_t len, std::size_t /* arena */, void* /* arg */) {
+    return munmap(addr, len) == 0;
+}
+
+static bool defaultExtentCommit(void* addr, std::size_t len, std::size_t /* arena */, void* /* arg */) {
+    return mprotect(addr, len, PROT_READ | PROT_WRITE) == 0;
+}
+
+/*  Mapped over with a fresh reservation, which drops the pages and their
+    commit charge */
+static bool defaultExtentDecommit(void* addr, std::size_t len, std::size_t /* arena */, void* /* arg */) {
+    return mmap(/* preferred addr  */ addr,
+                /* size            */ len,
+                /* protect flags   */ PROT_NONE,
+                /* map flags       */ MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                /* file descriptor */ -1,
+                /* chunk offset    */ 0) != MAP_FAILED;
+}
+
+static bool defaultExtentPurge(void* addr, std::size_t len, std::size_t /* arena */, void* /* arg */) {
+    return madvise(addr, len, MADV_DONTNEED) == 0;
+}
+#else
+static void* defaultExtentAlloc(std::size_t len, std::size_t /* arena */, void* /* arg */) {
+    return calloc(1, len);
+}
+
+static bool defaultExtentDalloc(void* addr, std::size_t /* len */, std::size_t /* arena */, void* /* arg */) {
+    free(addr);
+    return true;
+}
+#endif // __linux__
+
+Melloc::ExtentHooks Melloc::defaultExtentHooks() noexcept {
+    ExtentHooks hooks;
+    hooks.alloc = defaultExtentAlloc;
+    hooks.dalloc = defaultExtentDalloc;
+#ifdef __linux__
+    hooks.commit = defaultExtentCommit;
+    hooks.decommit = defaultExtentDecommit;
+    hooks.purge = defaultExtentPurge;
+#endif // __linux__
+    return hooks;
+}
+
+Melloc::Arena::Arena(std::size_t id, bool isPrivate, std::size_t node)
+    : id(id)
+    , isPrivate(isPrivate)
+    , node(node)
+    , hooks(defaultExtentHooks())
+{
+    if (heapBase) {
+        regionBase = reinterpret_cast<char*>(heapBase + id * ARENA_REGION_SIZE);
+        regionTop = regionBase;
+        regionCommitted = regionBase;
+    }
     init();
 }
 
 [[nodiscard]]
-void* Melloc::Arena::allocate(std::size_t sz,
-    Melloc::ThreadDescriptorWrapper& tdw) {
+void* Melloc::Arena::allocate(std::size_t sz, Melloc::ThreadDescriptor& td) {
     if (isLargeSize(sz)) {
         /*  Need to map large objects here in arena, since they don't 
             belong to a bin */
-        std::unique_lock writeLock(mutArena, std::defer_lock);
-#ifdef __linux__
-        pointer out = static_cast<pointer>(
-            mmap(/* preferred addr  */ nullptr,
-                 /* size            */ sz,
-                 /* protect flags   */ PROT_READ | PROT_WRITE,
-                 /* map flags       */ MAP_PRIVATE | MAP_ANONYMOUS,
-                 /* file descriptor */ 0,
-                 /* chunk offset    */ 0));
-        if (out == MAP_FAILED) {
-            exit(1);
-        }
-
-        writeLock.lock();
-        arenaUsedPages.emplace(getPage(out), sz, false);
-        mellocPrint("large object of size %zu mapped to 0x%x", sz, out);
-        return out;
-#else    
-        writeLock.lock();
-        void* out = malloc(sz);
-        arenaUsedPages.emplace(getPage(out), sz, false);
-        mellocPrint("large object of size %zu alloc'd to ptr 0x%x", sz, out);
-        return out;
-#endif // __linux__
+        return allocateLarge(sz);
     }
 
     /* Small objects are thread cacheable */
     std::size_t binIdx = getBinIdx(sz);
-    void* out = tdw->popCache(binIdx);
+    void* out = td.popCache(binIdx);
     if (out) {
         return out;
     }
 
-    /* Get small object from bin  */
-    return bins[binIdx].allocate();
+    /*  Get small objects from bin, keeping the rest of the batch cached */
+    std::array<void*, THREAD_CACHE_LIMIT> fill;
+    std::size_t n = bins[binIdx].allocateBatch(fill.data(), td.fillCount(binIdx));
+    if (n == 0) {
+        return nullptr;
+    }
+    td.pushCacheBatch(fill.data() + 1, n - 1, binIdx);
+    return fill[0];
 }
 
-void Melloc::Arena::deallocate(void* ptr) noexcept {
-    std::shared_lock readLock(mutArena);
-    auto pageIt = arenaUsedPages.lower_bound(getPage(ptr));
-    if (pageIt == arenaUsedPages.end() ||
-        (pageIt->isSlab &&
-         pageIt->page + pageIt->sizeInfo.slab.consecutive * PAGE_SIZE <= getPage(ptr))) {
-        /*  todo: freeing from a thread other than the original assignee is
-            stubbed for now. But we shouldn't be doing this anyways */
-        mellocPrint("bad to free from non-assignee thread");
-        exit(1);
+[[nodiscard]]
+void* Melloc::Arena::allocate(std::size_t sz, Lifetime lifetime) {
+    if (isLargeSize(sz)) {
+        return allocateLarge(sz, nullptr, lifetime);
+    }
+    return binsFor(lifetime)[getBinIdx(sz)].allocate();
+}
+
+[[nodiscard]]
+void* Melloc::Arena::allocateZeroed(std::size_t sz, std::size_t n,
+    Melloc::ThreadDescriptor& td) {
+    bool isZeroed = false;
+    void* out = nullptr;
+    if (isLargeSize(sz)) {
+        out = allocateLarge(sz, &isZeroed);
+    }
+    else {
+        /*  A cached chunk has always been used before */
+        std::size_t binIdx = getBinIdx(sz);
+        out = td.popCache(binIdx);
+        if (!out) {
+            out = bins[binIdx].allocate(&isZeroed);
+        }
+    }
+    if (out && !isZeroed) {
+        zeroMemory(out, n);
+    }
+    return out;
+}
+
+[[nodiscard]]
+void* Melloc::Arena::allocateLarge(std::size_t sz, bool* isZeroed, Lifetime lifetime) {
+    std::unique_lock writeLock(mutArena);
+    void* out = mapExtent(sz);
+    if (!out) {
+        return nullptr;
+    }
+    MELLOC_PROBE(large_mmap, id, sz);
+    arenaUsedPages.emplace(getPage(out), sz, false, lifetime);
+    mellocPrint("large object of size %zu mapped to 0x%x", sz, out);
+    if (isZeroed) {
+        *isZeroed = true;   /* extents are always handed out zeroed */
+    }
+    return out;
+}
+
+void* Melloc::Arena::mapExtent(std::size_t len) {
+    for (auto extentIt = freeExtents.begin(); extentIt != freeExtents.end(); ++extentIt) {
+        if (extentIt-> /* len */ second < len) {
+            continue;
+        }
+        void* out = extentIt-> /* ptr */ first;
+        if (extentIt->second > len) {
+            if (hooks.split && !hooks.split(out, extentIt->second, len, id, hooks.arg)) {
+                continue;
+            }
+            /* Change key of freeExtents without realloc using node handle */
+            auto nh = freeExtents.extract(extentIt);
+            nh.key() = increment(out, len);
+            nh.mapped() -= len;
+            freeExtents.insert(std::move(nh));
+        }
+        else {
+            freeExtents.erase(extentIt);
+        }
+        return out;
+    }
+
+    if (regionBase && hooks.commit
+        && len <= static_cast<std::size_t>(regionBase + ARENA_REGION_SIZE - regionTop)) {
+        if (regionTop + len > regionCommitted) {
+            if (!syscallAllowed(&SyscallReport::mmaps)) {
+                return nullptr;
+            }
+            std::size_t grow = (regionTop + len - regionCommitted + ARENA_COMMIT_SIZE - 1)
+                             & ~(ARENA_COMMIT_SIZE - 1);
+            grow = std::min<std::size_t>(grow, regionBase + ARENA_REGION_SIZE - regionCommitted);
+            if (!hooks.commit(regionCommitted, grow, id, hooks.arg)) {
+                mellocPrint("committing %zu bytes of arena %zu failed", grow, id);
+                return nullptr;
+            }
+            bindToNode(regionCommitted, grow, node);
+            regionCommitted += grow;
+        }
+        void* out = regionTop;
+        regionTop += len;
+        return out;
+    }
+
+    /*  Region full, never reserved, or not used by the hooks */
+    if (!syscallAllowed(&SyscallReport::mmaps)) {
+        return nullptr;
+    }
+    void* out = hooks.alloc ? hooks.alloc(len, id, hooks.arg) : nullptr;
+    if (!out) {
+        mellocPrint("mapping %zu bytes for arena %zu failed", len, id);
+        return nullptr;
+    }
+    bindToNode(out, len, node);
+    return out;
+}
+
+/*  Neighbouring free extents are merged, and an extent that ends up touching
+    regionTop is folded back into it */
+void Melloc::Arena::unmapExtent(void* ptr, std::size_t len) noexcept {
+    syscallAllowed(&SyscallReport::munmaps);
+    if (!inRegion(ptr) && hooks.dalloc && hooks.dalloc(ptr, len, id, hooks.arg)) {
         return;
     }
+    /*  Kept for reuse. Extents are handed out zeroed */
+    if (!hooks.purge || !hooks.purge(ptr, len, id, hooks.arg)) {
+        mellocPrint("purging extent 0x%x failed, clearing it", ptr);
+        zeroMemory(ptr, len);
+    }
+
+    auto right = freeExtents.find(increment(ptr, len));
+    if (right != freeExtents.end() && canMerge(ptr, len, right->first, right->second)) {
+        len += right-> /* len */ second;
+        freeExtents.erase(right);
+    }
+    auto left = freeExtents.lower_bound(ptr);
+    if (left != freeExtents.begin()) {
+        --left;
+        if (increment(left-> /* ptr */ first, left-> /* len */ second) == ptr
+            && canMerge(left->first, left->second, ptr, len)) {
+            ptr = left->first;
+            len += left->second;
+            freeExtents.erase(left);
+        }
+    }
+    if (inRegion(ptr) && increment(ptr, len) == regionTop) {
+        regionTop = static_cast<char*>(ptr);
+    }
+    else {
+        freeExtents.emplace(ptr, len);
+    }
+}
+
+/*  Never across the region's edge, so regionTop only ever folds in-region
+    extents */
+bool Melloc::Arena::canMerge(void* a, std::size_t aLen, void* b, std::size_t bLen) noexcept {
+    return inRegion(a) == inRegion(b)
+        && (!hooks.merge || hooks.merge(a, aLen, b, bLen, id, hooks.arg));
+}
+
+void Melloc::Arena::decommit() noexcept {
+    std::unique_lock writeLock(mutArena);
+    for (auto& [ptr, len] : freeExtents) {
+        if (!inRegion(ptr) && hooks.dalloc) {
+            hooks.dalloc(ptr, len, id, hooks.arg);
+        }
+    }
+    freeExtents.clear();
+    if (regionCommitted > regionBase && hooks.decommit) {
+        hooks.decommit(regionBase, regionCommitted - regionBase, id, hooks.arg);
+    }
+    regionTop = regionBase;
+    regionCommitted = regionBase;
+}
+
+bool Melloc::Arena::deallocate(void* ptr) noexcept {
+    std::shared_lock readLock(mutArena);
+    auto pageIt = findUsedPage(ptr);
+    if (pageIt == arenaUsedPages.end()) {
+        /*  Allocated by a thread assigned to another arena */
+        return false;
+    }
 
     /*  Large chunks are not thread cacheable */
     if (!pageIt->isSlab) {
-#ifdef __linux__
-        if (munmap(ptr, pageIt->sizeInfo.len) == -1) {
-            exit(1);
-        }
-        mellocPrint("unmapped large object at 0x%x", ptr);
-#else
-        free(ptr);
-#endif // __linux
-        return;
+        readLock.unlock();
+        deallocateDirect(ptr);
+        return true;
     }
 
-    /*  Small or medium chunks are thread cacheable */
+    /*  Small or medium chunks are thread cacheable, unless long-lived */
     std::size_t binIdx = pageIt->sizeInfo.slab.binIdx;
-    std::thread::id tid = std::this_thread::get_id();
-    auto threadDescriptorIt = threadDescriptors.find(tid);
+    if (pageIt->lifetime == Lifetime::Long) {
+        readLock.unlock();
+        longLivedBins[binIdx].giveBack(ptr);
+        return true;
+    }
+    readLock.unlock();
+    auto threadDescriptorIt = findThreadDescriptor();
     assert(threadDescriptorIt != threadDescriptors.end());
 
     Melloc::ThreadDescriptorWrapper& tdw = threadDescriptorIt->second;
     tdw->pushCache(ptr, binIdx);
+    return true;
+}
+
+bool Melloc::Arena::owns(void* ptr) noexcept {
+    std::shared_lock readLock(mutArena);
+    return findUsedPage(ptr) != arenaUsedPages.end();
+}
+
+std::size_t Melloc::Arena::usableSize(void* ptr) noexcept {
+    std::shared_lock readLock(mutArena);
+    auto pageIt = findUsedPage(ptr);
+    if (pageIt == arenaUsedPages.end()) {
+        return 0;
+    }
+    return pageIt->isSlab
+        ? smallSizeClasses[pageIt->sizeInfo.slab.binIdx]
+        : pageIt->sizeInfo.len;
+}
+
+std::size_t Melloc::Arena::binOf(void* ptr) noexcept {
+    std::shared_lock readLock(mutArena);
+    auto pageIt = findUsedPage(ptr);
+    if (pageIt == arenaUsedPages.end() || !pageIt->isSlab
+        || pageIt->lifetime != Lifetime::Short) {
+        return bins.size();
+    }
+    return pageIt->sizeInfo.slab.binIdx;
+}
+
+/*  Descriptor of the slab or large object containing ptr, or end(). Caller
+    holds mutArena */
+std::set<Melloc::Arena::PageDescriptor>::iterator
+Melloc::Arena::findUsedPage(void* ptr) noexcept {
+    auto pageIt = arenaUsedPages.lower_bound(getPage(ptr));
+    if (pageIt == arenaUsedPages.end()) {
+        return pageIt;
+    }
+    std::size_t len = pageIt->isSlab
+        ? pageIt->sizeInfo.slab.consecutive * PAGE_SIZE
+        : pageIt->sizeInfo.len;
+    if (pageIt->page + len <= getPage(ptr)) {
+        return arenaUsedPages.end();
+    }
+    return pageIt;
+}
+
+void Melloc::Arena::deallocateDirect(void* ptr) noexcept {
+    std::unique_lock writeLock(mutArena);
+    auto pageIt = findUsedPage(ptr);
+    if (pageIt == arenaUsedPages.end()) {
+        mellocPrint("ptr 0x%x does not belong to arena %zu", ptr, id);
+        fatal();
+        return;
+    }
+
+    if (pageIt->isSlab) {
+        Bin& b = binsFor(pageIt->lifetime)[pageIt->sizeInfo.slab.binIdx];
+        writeLock.unlock();
+        b.giveBack(ptr);
+        return;
+    }
+
+    unmapExtent(ptr, pageIt->sizeInfo.len);
+    MELLOC_PROBE(large_munmap, id, pageIt->sizeInfo.len);
+    mellocPrint("unmapped large object at 0x%x", ptr);
+    arenaUsedPages.erase(pageIt);
+}
+
+std::size_t Melloc::Arena::deallocateRun(void** ptrs, std::size_t count,
+    ThreadDescriptor* td) noexcept {
+    std::shared_lock readLock(mutArena);
+    auto pageIt = findUsedPage(ptrs[0]);
+    if (pageIt == arenaUsedPages.end()) {
+        return 0;
+    }
+    if (!pageIt->isSlab) {
+        readLock.unlock();
+        deallocateDirect(ptrs[0]);
+        return 1;
+    }
+
+    Page end = pageIt->page + pageIt->sizeInfo.slab.consecutive * PAGE_SIZE;
+    std::size_t binIdx = pageIt->sizeInfo.slab.binIdx;
+    Lifetime lifetime = pageIt->lifetime;
+    readLock.unlock();
+    std::size_t n = 1;
+    while (n < count && reinterpret_cast<Page>(ptrs[n]) < end) {
+        ++n;
+    }
+
+    std::size_t cached = td && lifetime == Lifetime::Short
+        ? td->pushCacheBatch(ptrs, n, binIdx)
+        : 0;
+    if (cached < n) {
+        binsFor(lifetime)[binIdx].giveBackBatch(ptrs + cached, n - cached);
+    }
+    return n;
+}
+
+/*  Walks the page descriptors rather than the objects, so the cost is linear in
+    the number of slabs and large objects no matter how many objects were handed
+    out. Only private arenas are reset, since no thread cache can be holding
+    their chunks */
+void Melloc::Arena::reset(bool retain) noexcept {
+    assert(isPrivate);
+    forEachBin([retain](Bin& b) { b.reset(retain); });
+
+    std::unique_lock writeLock(mutArena);
+    for (auto pageIt = arenaUsedPages.begin(); pageIt != arenaUsedPages.end(); ) {
+        if (pageIt->isSlab && retain) {
+            ++pageIt;
+            continue;
+        }
+
+        void* start = reinterpret_cast<void*>(pageIt->page);
+        std::size_t len = pageIt->isSlab
+            ? pageIt->sizeInfo.slab.consecutive * PAGE_SIZE
+            : pageIt->sizeInfo.len;
+        unmapExtent(start, len);
+        if (pageIt->isSlab) {
+            MELLOC_PROBE(slab_munmap, id, smallSizeClasses[pageIt->sizeInfo.slab.binIdx], len);
+        }
+        else {
+            MELLOC_PROBE(large_munmap, id, len);
+        }
+        pageIt = arenaUsedPages.erase(pageIt);
+    }
+    mellocPrint("arena %zu reset, %zu slabs retained", id, arenaUsedPages.size());
 }
 
 void Melloc::Arena::init() {
     /*  Populate all bins */
     assert(bins.size() > 0);
     for (int i = 0; i < bins.size(); ++i) {
-        Bin& b = bins[i];
-        b.myArena = id;
-        b.binIdx = i;
-        void* out = nullptr;
-        std::size_t objs = 0;
-        std::size_t consecutive = 1;
-        std::size_t sizeClass = smallSizeClasses[i];
-        std::size_t sizeLim = PAGE_SIZE / MMAP_MIN_OBJECTS_TAKEN;
-        std::size_t slab = PAGE_SIZE;
-
-        if (sizeClass < sizeLim) {
-            /* Get one page */
-            objs = PAGE_SIZE / sizeClass;
-        }
-        else {
-            slab = ((32 * sizeClass) & PAGE_MASK) + PAGE_SIZE * (isOffPage(32 * sizeClass));
-            consecutive = slab / PAGE_SIZE;
-            objs = slab / sizeClass;
-        }
-#ifdef __linux__
-        out = sbrk(slab);
-#else
-        out = malloc(slab);
-#endif // __linux__
-        assert(out != nullptr);
-        assert(consecutive > 0);
-        std::unique_lock writeLockArena(mutArena);
-        arenaUsedPages.emplace(getPage(out), i, consecutive, true);
-        writeLockArena.unlock();
-        std::unique_lock writeLockBin(b.mutBin);
-        b.binFreeChunks.emplace(out, objs);
+        /*  Bins start empty and carve slabs from the region on demand */
+        bins[i].myArena = id;
+        bins[i].binIdx = i;
+        longLivedBins[i].myArena = id;
+        longLivedBins[i].binIdx = i;
+        longLivedBins[i].lifetime = Lifetime::Long;
     }
     mellocPrint("arena %zu inited ", this->id);
 }
\ No newline at end of file
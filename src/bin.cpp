@@ -19,82 +19,126 @@
 
 #include "melloc.h"
 #include "melloc_defs.h"
+#include "melloc_probes.h"
 #include "melloc_utils.h"
 
 
-void* Melloc::Arena::Bin::allocate() {
+void* Melloc::Arena::Bin::allocate(bool* isZeroed) {
     std::unique_lock writeLock(mutBin, std::defer_lock);
     mellocPrint("allocation request on bin of sz %zu", smallSizeClasses[this->binIdx]);
-    std::size_t sizeClass = smallSizeClasses[binIdx];
     void* out = nullptr;
 
-    // first look through free list
     writeLock.lock();
-    if (!binFreeChunks.empty()) {
-        auto chunkIterator = binFreeChunks.begin();
-        out = chunkIterator-> /* ptr */ first;
-        if (--chunkIterator-> /* consecutive */ second > 0) {
-            /* Change key of binFreeChunks without realloc using node handle */
-            mellocPrint("decremented bin %zu chunk's consecutive, now becomes %zu ", sizeClass, chunkIterator->second);
-            auto nh = binFreeChunks.extract(chunkIterator);
-            nh.key() = increment(out, sizeClass);
-            binFreeChunks.insert(std::move(nh));
-        }
-        else {
-            mellocPrint("removed bin %zu chunk ", sizeClass);
-            binFreeChunks.erase(chunkIterator);
+    if (!takeRun(&out, 1, isZeroed)) {
+        return nullptr;
+    }
+    MELLOC_PROBE(bin_refill, myArena, smallSizeClasses[binIdx], 1);
+    mellocPrint("returning ptr from bin: 0x%x", out);
+    return out;
+}
+
+/*  Fill out with count chunks under a single acquisition of mutBin, taking
+    whole runs of consecutive chunks at a time */
+std::size_t Melloc::Arena::Bin::allocateBatch(void** out, std::size_t count) {
+    std::unique_lock writeLock(mutBin);
+    std::size_t taken = 0;
+    while (taken < count) {
+        std::size_t run = takeRun(out + taken, count - taken, nullptr);
+        if (!run) {
+            break;
         }
+        taken += run;
+    }
+    MELLOC_PROBE(bin_refill, myArena, smallSizeClasses[binIdx], taken);
+    mellocPrint("bin sz %zu handed out a batch of %zu", smallSizeClasses[binIdx], taken);
+    return taken;
+}
+
+/*  Takes up to count chunks from the front of one free run, mapping a new slab
+    first if the bin is out of chunks. isZeroed is set if every chunk taken
+    was untouched. Caller holds mutBin */
+std::size_t Melloc::Arena::Bin::takeRun(void** out, std::size_t count, bool* isZeroed) {
+    std::size_t sizeClass = smallSizeClasses[binIdx];
+
+    // if the free list is empty, ask OS for slab (some contiguous pages)
+    if (binFreeChunks.empty() && !mapSlab()) {
+        return 0;
     }
 
-    // otherwise, ask OS for slab (some contiguous pages)
+    // take chunks off the front of a free run
+    auto chunkIterator = pickChunk();
+    void* first = chunkIterator-> /* ptr */ first;
+    std::size_t taken = std::min(count, chunkIterator-> /* consecutive */ second);
+    for (std::size_t i = 0; i < taken; ++i) {
+        out[i] = increment(first, i * sizeClass);
+    }
+    if ((chunkIterator-> /* consecutive */ second -= taken) > 0) {
+        /* Change key of binFreeChunks without realloc using node handle */
+        mellocPrint("decremented bin %zu chunk's consecutive, now becomes %zu ", sizeClass, chunkIterator->second);
+        auto nh = binFreeChunks.extract(chunkIterator);
+        nh.key() = increment(first, taken * sizeClass);
+        binFreeChunks.insert(std::move(nh));
+    }
     else {
-        std::size_t objs = 0;
-        std::size_t consecutive = 1;
-        std::size_t sizeLim = PAGE_SIZE / MMAP_MIN_OBJECTS_TAKEN;
-        std::size_t slab = PAGE_SIZE;
-        if (sizeClass < sizeLim) {
-            /* Get one page */
-            objs = PAGE_SIZE / sizeClass;
-        }
-        else {
-            slab = ((32 * sizeClass) & PAGE_MASK) + PAGE_SIZE * (isOffPage(32 * sizeClass));
-            consecutive = slab / PAGE_SIZE;
-            objs = slab / sizeClass;
-        }
-#ifdef __linux__
-        out = mmap(/* preferred addr  */ nullptr,
-                   /* size            */ slab,
-                   /* protect flags   */ PROT_READ | PROT_WRITE,
-                   /* map flags       */ MAP_PRIVATE | MAP_ANONYMOUS,
-                   /* file descriptor */ 0,
-                   /* chunk offset    */ 0);
-#else
-        out = malloc(slab);
-#endif // __linux__
-        objs = slab / sizeClass;
-        mellocPrint("Bin sz %zu asked kernel for %zu bytes", sizeClass, slab);
-        assert(getPage(out));
-        
-        std::unique_lock writeLockArena(arenas[myArena].mutArena);
-        arenas[myArena].arenaUsedPages.emplace(getPage(out), binIdx, consecutive, true);
-        writeLockArena.unlock();
-        binFreeChunks.emplace(increment(out, sizeClass), objs - 1);
+        mellocPrint("removed bin %zu chunk ", sizeClass);
+        binFreeChunks.erase(chunkIterator);
     }
 
-    mellocPrint("returning ptr from bin: 0x%x", out);
-    return out;
+    auto slabIt = findSlab(first);
+    setFree(slabIt, slabIt->second.nFree - taken);
+    void* end = increment(first, taken * sizeClass);
+    bool untouched = first >= slabIt->second.untouched;
+    if (end > slabIt->second.untouched) {
+        slabIt->second.untouched = end;
+    }
+    if (isZeroed) {
+        *isZeroed = untouched;
+    }
+    return taken;
 }
 
 
 void Melloc::Arena::Bin::giveBack(void* ptr) {
-    std::unique_lock writeLock(mutBin, std::defer_lock);
+    std::unique_lock writeLock(mutBin);
+    giveBackLocked(ptr);
+    MELLOC_PROBE(bin_give_back, myArena, smallSizeClasses[binIdx], 1);
+}
+
+/*  Give back chunks of this bin under a single acquisition of mutBin */
+void Melloc::Arena::Bin::giveBackBatch(void** ptrs, std::size_t count) {
+    std::unique_lock writeLock(mutBin);
+    for (std::size_t i = 0; i < count; ++i) {
+        giveBackLocked(ptrs[i]);
+    }
+    MELLOC_PROBE(bin_give_back, myArena, smallSizeClasses[binIdx], count);
+}
+
+/*  Caller holds mutBin */
+void Melloc::Arena::Bin::giveBackLocked(void* ptr) {
     std::size_t sizeClass = smallSizeClasses[binIdx];
     mellocPrint("giving back ptr 0x%x to sizeclass %zu", ptr, sizeClass);
     
-    /* check if we can merge existing free entries */
-    writeLock.lock();
-    auto left = binFreeChunks.find(decrement(ptr, sizeClass));
-    auto right = binFreeChunks.find(increment(ptr, sizeClass));
+    /* check if we can merge existing free entries within the same slab */
+    auto slabIt = findSlab(ptr);
+    void* slabStart = slabIt->first;
+    void* slabEnd = increment(slabStart, slabIt->second.nObjs * sizeClass);
+
+    auto right = binFreeChunks.end();
+    if (increment(ptr, sizeClass) < slabEnd) {
+        right = binFreeChunks.find(increment(ptr, sizeClass));
+    }
+    auto left = binFreeChunks.lower_bound(ptr);
+    if (left != binFreeChunks.begin()) {
+        --left;
+        if (left-> /* ptr */ first < slabStart ||
+            increment(left-> /* ptr */ first, left-> /* consecutive */ second * sizeClass) != ptr) {
+            left = binFreeChunks.end();
+        }
+    }
+    else {
+        left = binFreeChunks.end();
+    }
+
     if (left != binFreeChunks.end()) {
         ++left-> /* consecutive */ second;
     }
@@ -107,4 +151,187 @@ void Melloc::Arena::Bin::giveBack(void* ptr) {
         }
         binFreeChunks.erase(right);
     }
+    else if (left == binFreeChunks.end()) {
+        binFreeChunks.emplace(ptr, 1);
+    }
+    setFree(slabIt, slabIt->second.nFree + 1);
+}
+
+/*  Carve a fresh slab out of the arena and track it. Caller holds mutBin.
+
+    Slabs start on a page, so without coloring chunk N of every slab of a
+    class would map to the same cache sets, and walking the same field of many
+    objects would keep evicting itself. The space left over after the last
+    chunk is used to shift each new slab's first chunk by a further cache line,
+    wrapping around when the tail (or a page) runs out */
+void* Melloc::Arena::Bin::mapSlab() {
+    std::size_t sizeClass = smallSizeClasses[binIdx];
+    std::size_t slab = getSlabSize(sizeClass);
+    std::size_t consecutive = slab / PAGE_SIZE;
+    std::size_t objs = slab / sizeClass;
+    std::size_t colors = std::min<std::size_t>(slab - objs * sizeClass, PAGE_SIZE - 1)
+                         / CACHE_LINE_SIZE + 1;
+    std::size_t color = nextColor++ % colors * CACHE_LINE_SIZE;
+
+    Arena& arena = *arenas[myArena];
+    std::unique_lock writeLockArena(arena.mutArena);
+    void* slabPtr = arena.mapExtent(slab);
+    if (!slabPtr) {
+        return nullptr;
+    }
+    mellocPrint("Bin sz %zu took %zu bytes from its arena", sizeClass, slab);
+    MELLOC_PROBE(slab_mmap, myArena, sizeClass, slab);
+    arena.arenaUsedPages.emplace(getPage(slabPtr), binIdx, consecutive, true, lifetime);
+    writeLockArena.unlock();
+    void* first = increment(slabPtr, color);
+    addSlab(first, objs);
+    return first;
+}
+
+/*  Slabs that already have free chunks count towards count. Pages past a
+    slab's untouched mark may never have been faulted in, so one byte of each
+    is written; it is zero there already. Pinned slabs are marked not releasable,
+    so neither releaseEmptySlabs() nor reclaim() unmaps them */
+bool Melloc::Arena::Bin::reserve(std::size_t count, bool lockPages) {
+    std::unique_lock writeLock(mutBin);
+    std::size_t sizeClass = smallSizeClasses[binIdx];
+    std::size_t slabBytes = getSlabSize(sizeClass);
+    std::size_t free = 0;
+    bool locked = true;
+    auto pin = [&](void* slab, SlabInfo& info) {
+        char* end = static_cast<char*>(increment(slab, info.nObjs * sizeClass));
+        for (char* c = static_cast<char*>(info.untouched); c < end;
+             c = reinterpret_cast<char*>(getPage(c + PAGE_SIZE))) {
+            *static_cast<volatile char*>(c) = 0;
+        }
+#ifdef __linux__
+        if (lockPages && mlock(reinterpret_cast<void*>(getPage(slab)), slabBytes) == -1) {
+            locked = false;
+        }
+#endif // __linux__
+        info.releasable = false;
+        free += info.nFree;
+    };
+
+    for (auto& [slab, info] : slabs) {
+        if (info.nFree > 0) {
+            pin(slab, info);
+        }
+    }
+    while (free < count) {
+        void* slab = mapSlab();
+        if (!slab) {
+            return false;
+        }
+        pin(slab, slabs.at(slab));
+    }
+    mellocPrint("bin sz %zu reserved %zu free chunks", sizeClass, free);
+    return locked;
+}
+
+/*  Track a fresh slab whose chunks are all free and zero. Caller holds
+    mutBin */
+void Melloc::Arena::Bin::addSlab(void* slab, std::size_t objs) {
+    slabs.emplace(slab, SlabInfo{objs, objs, true, slab});
+    binFreeChunks.emplace(slab, objs);
+    emptySlabs.insert(slab);
+}
+
+/*  Give every empty slab back to the arena. Slabs pinned by reserve() stay */
+std::size_t Melloc::Arena::Bin::releaseEmptySlabs() noexcept {
+    std::unique_lock writeLock(mutBin);
+    std::size_t sizeClass = smallSizeClasses[binIdx];
+    std::size_t slabBytes = getSlabSize(sizeClass);
+    std::size_t released = 0;
+    for (auto emptyIt = emptySlabs.begin(); emptyIt != emptySlabs.end(); ) {
+        auto slabIt = slabs.find(*emptyIt);
+        assert(slabIt != slabs.end());
+        if (!slabIt->second.releasable) {
+            ++emptyIt;
+            continue;
+        }
+        void* slab = *emptyIt;
+        binFreeChunks.erase(slab);
+        slabs.erase(slabIt);
+        emptyIt = emptySlabs.erase(emptyIt);
+
+        std::unique_lock writeLockArena(arenas[myArena]->mutArena);
+        arenas[myArena]->arenaUsedPages.erase(getPage(slab));
+        arenas[myArena]->unmapExtent(reinterpret_cast<void*>(getPage(slab)), slabBytes);
+        writeLockArena.unlock();
+        MELLOC_PROBE(slab_munmap, myArena, sizeClass, slabBytes);
+        released += slabBytes;
+    }
+    if (released) {
+        mellocPrint("bin %zu released %zu bytes of empty slabs", sizeClass, released);
+    }
+    return released;
+}
+
+void Melloc::Arena::Bin::reset(bool retain) noexcept {
+    std::unique_lock writeLock(mutBin);
+    binFreeChunks.clear();
+    partialSlabs.clear();
+    emptySlabs.clear();
+    if (!retain) {
+        slabs.clear();
+        return;
+    }
+    for (auto& [slab, info] : slabs) {
+        info.nFree = info.nObjs;
+        binFreeChunks.emplace(slab, info.nObjs);
+        emptySlabs.insert(slab);
+    }
+}
+
+/*  Free run to allocate from next. Caller holds mutBin and has made sure
+    binFreeChunks is not empty */
+std::map<void*, std::size_t>::iterator Melloc::Arena::Bin::pickChunk() noexcept {
+    assert(!binFreeChunks.empty());
+    if (slabPolicy.load(std::memory_order_relaxed) == SlabPolicy::AddressOrdered) {
+        return binFreeChunks.begin();
+    }
+    void* slab = partialSlabs.empty()
+        ? *emptySlabs.begin()
+        : partialSlabs.begin()-> /* slab */ second;
+    auto chunkIterator = binFreeChunks.lower_bound(slab);
+    assert(chunkIterator != binFreeChunks.end());
+    return chunkIterator;
+}
+
+/*  Slab containing ptr. Caller holds mutBin */
+Melloc::Arena::Bin::SlabMap::iterator Melloc::Arena::Bin::findSlab(void* ptr) noexcept {
+    auto slabIt = slabs.upper_bound(ptr);
+    assert(slabIt != slabs.begin());
+    return --slabIt;
+}
+
+/*  Reuses the partialSlabs node when a slab stays partial, which is the common
+    case, so only a slab turning full or empty touches the heap */
+void Melloc::Arena::Bin::setFree(SlabMap::iterator slabIt, std::size_t nFree) noexcept {
+    void* slab = slabIt->first;
+    SlabInfo& info = slabIt->second;
+    bool wasPartial = info.nFree > 0 && info.nFree < info.nObjs;
+    bool isPartial = nFree > 0 && nFree < info.nObjs;
+
+    if (wasPartial && isPartial) {
+        auto nh = partialSlabs.extract({info.nFree, slab});
+        nh.value().first = nFree;
+        partialSlabs.insert(std::move(nh));
+    }
+    else {
+        if (wasPartial) {
+            partialSlabs.erase({info.nFree, slab});
+        }
+        else if (info.nFree == info.nObjs) {
+            emptySlabs.erase(slab);
+        }
+        if (isPartial) {
+            partialSlabs.emplace(nFree, slab);
+        }
+        else if (nFree == info.nObjs) {
+            emptySlabs.insert(slab);
+        }
+    }
+    info.nFree = nFree;
 }
\ No newline at end of file
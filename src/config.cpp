@@ -0,0 +1,120 @@
+/**
+ * @file config.cpp
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Runtime tunables
+ * @version 1.0
+ * @date 2023-11-24
+ *
+ *
+ * Parses MELLOC_CONF style strings in place, without allocating or copying,
+ * since this runs before any arena exists.
+ *
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <limits>
+
+#include "melloc.h"
+#include "melloc_conf.h"
+#include "melloc_defs.h"
+#include "melloc_utils.h"
+
+
+/*  Key of every tunable and where it lives */
+struct ConfKey {
+    const char*                 name;
+    std::size_t MellocConfig::* field;
+};
+
+static constexpr ConfKey confKeys[] = {
+    {"narenas",                 &MellocConfig::narenas},
+    {"tcache_min",              &MellocConfig::tcacheMin},
+    {"tcache_max",              &MellocConfig::tcacheMax},
+    {"tcache_default_bytes",    &MellocConfig::tcacheDefaultBytes},
+    {"tcache_class_bytes",      &MellocConfig::tcacheClassBytes},
+    {"tcache_budget",           &MellocConfig::tcacheBudget},
+    {"tcache_grow_events",      &MellocConfig::tcacheGrowEvents},
+    {"slab_min_objects",        &MellocConfig::slabMinObjects},
+    {"purge_ms",                &MellocConfig::purgeMs},
+    {"decay_ticks",             &MellocConfig::decayTicks},
+};
+
+/*  Parses an unsigned number with an optional k/m/g suffix from [c, end).
+    Fails if it doesn't fit a std::size_t */
+static bool parseSize(const char* c, const char* end, std::size_t& out) noexcept {
+    if (c == end) {
+        return false;
+    }
+    constexpr std::size_t maxVal = std::numeric_limits<std::size_t>::max();
+    std::size_t val = 0;
+    while (c != end && *c >= '0' && *c <= '9') {
+        std::size_t digit = *c++ - '0';
+        if (val > (maxVal - digit) / 10) {
+            return false;
+        }
+        val = val * 10 + digit;
+    }
+    if (c != end) {
+        unsigned shift = 0;
+        switch (*c++) {
+            case 'k': case 'K': shift = 10; break;
+            case 'm': case 'M': shift = 20; break;
+            case 'g': case 'G': shift = 30; break;
+            default: return false;
+        }
+        if (val > (maxVal >> shift)) {
+            return false;
+        }
+        val <<= shift;
+    }
+    if (c != end) {
+        return false;
+    }
+    out = val;
+    return true;
+}
+
+bool parseMellocConf(MellocConfig& config, const char* conf) noexcept {
+    bool ok = true;
+    const char* c = conf;
+    while (*c) {
+        const char* pairEnd = std::strchr(c, ',');
+        if (!pairEnd) {
+            pairEnd = c + std::strlen(c);
+        }
+        const char* colon = static_cast<const char*>(std::memchr(c, ':', pairEnd - c));
+        bool known = false;
+        if (colon) {
+            for (const ConfKey& key : confKeys) {
+                std::size_t len = std::strlen(key.name);
+                if (static_cast<std::size_t>(colon - c) == len && std::strncmp(c, key.name, len) == 0) {
+                    known = parseSize(colon + 1, pairEnd, config.*key.field);
+                    break;
+                }
+            }
+        }
+        if (!known && pairEnd != c) {
+            mellocPrint("bad melloc conf pair %.*s", static_cast<int>(pairEnd - c), c);
+            ok = false;
+        }
+        c = *pairEnd ? pairEnd + 1 : pairEnd;
+    }
+    return ok;
+}
+
+bool Melloc::configure(const char* conf) noexcept {
+    std::unique_lock writeLock(mutMelloc);
+    if (initialized.load(std::memory_order_relaxed)) {
+        mellocPrint("configure() after the first allocation has no effect");
+        return false;
+    }
+    bool ok = parseMellocConf(mellocConf, conf);
+    mellocConf.finalize();
+    return ok;
+}
+
+const MellocConfig& Melloc::getConfig() noexcept {
+    return mellocConf;
+}
@@ -13,21 +13,25 @@
  */
 
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <functional>
 #include <shared_mutex>
+#ifdef __linux__
+#include <sched.h>
+#endif // __linux__
 
 #include "melloc.h"
 #include "melloc_defs.h"
+#include "melloc_probes.h"
+#include "melloc_trace.h"
 #include "melloc_utils.h"
 
 
 #ifdef __linux__
-#else
-void* sbrk(size_t bytes) {
-    /* stub for non-linux builds */
-    return static_cast<void*>(malloc(bytes));
-}
-#endif
+#include <sys/mman.h>
+#endif // __linux__
 
 
 /* Constructor */
@@ -36,65 +40,719 @@ Melloc::Melloc() {init();};
 /* Allocate memory */
 [[nodiscard]]
 void* Melloc::allocate(std::size_t n) {
+    ensureInit();
     std::shared_lock readLock(mutMelloc);
     std::size_t sz = roundup(n);
-    std::thread::id tid = std::this_thread::get_id();
-    
-    auto threadDescriptorIt = threadDescriptors.find(tid);
-    if (threadDescriptorIt == threadDescriptors.end()) {
-        /*  First allocation for this thread, assign via round-robin.
-            Initialize thread cache as well */
-        readLock.unlock();
-        std::unique_lock writeLock(mutMelloc);
-        threadDescriptorIt = threadDescriptors.emplace(
-            tid, tid /* ThreadDescriptorWrapper(tid) */).first;
-        writeLock.unlock();
-        readLock.lock();
+    void* out = nullptr;
+#if MELLOC_PERCPU_CACHE
+    out = allocatePerCpu(sz);
+#endif // MELLOC_PERCPU_CACHE
+    if (!out && !perCpuRefused()) {
+        ThreadDescriptorWrapper& tdw = getThreadDescriptor(readLock);
+        Arena& arena = *arenas[tdw->myArena];
+        out = arena.allocate(sz, *tdw.get());
     }
-    assert(threadDescriptorIt != threadDescriptors.end());
-    Arena& arena = arenas[threadDescriptorIt->second->myArena];
-    
-    return arena.allocate(sz, threadDescriptorIt->second);
+    if (threadTag != untagged && out) {
+        tagAllocated(threadTag, sz, 1);
+    }
+    if (traceEnabled()) {
+        traceRecord(TraceOp::Allocate, n, out);
+    }
+    return out;
+}
+
+void* Melloc::allocate(std::size_t n, Tag tag) {
+    TagScope scope(tag);
+    return allocate(n);
+}
+
+/*  Long-lived objects skip the caches in both directions: a cached chunk would
+    be handed to the next short-lived allocation of its class and pin its slab */
+[[nodiscard]]
+void* Melloc::allocate(std::size_t n, Lifetime lifetime) {
+    if (lifetime == Lifetime::Short) {
+        return allocate(n);
+    }
+    ensureInit();
+    std::shared_lock readLock(mutMelloc);
+    void* out = nullptr;
+    if (!perCpuRefused()) {
+        out = arenas[callerArena(readLock)]->allocate(roundup(n), lifetime);
+    }
+    if (threadTag != untagged && out) {
+        tagAllocated(threadTag, roundup(n), 1);
+    }
+    if (traceEnabled()) {
+        traceRecord(TraceOp::Allocate, n, out);
+    }
+    return out;
+}
+
+/*  Allocate zeroed memory. Chunks that were never handed out since their slab
+    or extent was mapped are already zero and are not cleared again, which also
+    saves faulting in their pages */
+[[nodiscard]]
+void* Melloc::allocateZeroed(std::size_t n) {
+    ensureInit();
+    std::shared_lock readLock(mutMelloc);
+    std::size_t sz = roundup(n);
+    void* out = nullptr;
+#if MELLOC_PERCPU_CACHE
+    bool isZeroed = false;
+    out = allocatePerCpu(sz, &isZeroed);
+    if (out && !isZeroed) {
+        zeroMemory(out, n);
+    }
+#endif // MELLOC_PERCPU_CACHE
+    if (!out && !perCpuRefused()) {
+        ThreadDescriptorWrapper& tdw = getThreadDescriptor(readLock);
+        Arena& arena = *arenas[tdw->myArena];
+        out = arena.allocateZeroed(sz, n, *tdw.get());
+    }
+    if (threadTag != untagged && out) {
+        tagAllocated(threadTag, sz, 1);
+    }
+    if (traceEnabled()) {
+        traceRecord(TraceOp::AllocateZeroed, n, out);
+    }
+    return out;
 }
 
 /*  Free memory. Caller is responsible for ensuring the address is valid (ie.
     has previously been returned by allocate()), else undefined behavior, 
     like in malloc */
 void Melloc::deallocate(void* ptr) noexcept {
+    if (threadTag != untagged && ptr) {
+        tagFreed(threadTag, usableSize(ptr), 1);
+    }
+    deallocateUncharged(ptr);
+}
+
+void Melloc::deallocate(void* ptr, std::size_t n) noexcept {
+    deallocate(ptr, n, threadTag);
+}
+
+/*  The size class comes from n, so tagged objects need no header */
+void Melloc::deallocate(void* ptr, std::size_t n, Tag tag) noexcept {
+    if (tag != untagged && ptr) {
+        tagFreed(tag, roundup(n), 1);
+    }
+    deallocateUncharged(ptr);
+}
+
+void Melloc::deallocateUncharged(void* ptr) noexcept {
+    if (traceEnabled()) {
+        traceRecord(TraceOp::Deallocate, 0, ptr);
+    }
     std::shared_lock readLock(mutMelloc);
-    auto threadDescriptorIt = threadDescriptors.find(std::this_thread::get_id());
-    assert(threadDescriptorIt != threadDescriptors.end());
-    Arena& arena = arenas[threadDescriptorIt->second->myArena];
-    arena.deallocate(ptr);
+#if MELLOC_PERCPU_CACHE
+    if (deallocatePerCpu(ptr)) {
+        return;
+    }
+#endif // MELLOC_PERCPU_CACHE
+    auto threadDescriptorIt = findThreadDescriptor();
+    std::size_t myArena = numArenas;
+    if (threadDescriptorIt != threadDescriptors.end()) {
+        myArena = threadDescriptorIt->second->myArena;
+        if (arenas[myArena]->deallocate(ptr)) {
+            return;
+        }
+    }
+    /*  else this thread never allocated, or is exiting and already gave its
+        descriptor back */
+
+    /*  Allocated by a thread on another arena, so it cannot go through our
+        thread cache. Give it straight back to the owning bin */
+    std::size_t owner = regionArena(ptr);
+    if (owner < numArenas && owner != myArena) {
+        arenas[owner]->deallocateDirect(ptr);
+        return;
+    }
+    /*  Outside the regions: mapped after its arena's region filled up */
+    for (std::size_t i = 0; i < numArenas; ++i) {
+        if (i != myArena && arenas[i]->owns(ptr)) {
+            arenas[i]->deallocateDirect(ptr);
+            return;
+        }
+    }
+    mellocPrint("ptr 0x%x was not allocated by melloc", ptr);
+    fatal();
+}
+
+/*  Found the same way deallocate() finds the owning arena, but read only */
+std::size_t Melloc::usableSize(void* ptr) noexcept {
+    if (!ptr) {
+        return 0;
+    }
+    std::shared_lock readLock(mutMelloc);
+    std::size_t owner = regionArena(ptr);
+    if (owner < MAX_ARENAS && arenas[owner]) {
+        std::size_t len = arenas[owner]->usableSize(ptr);
+        if (len) {
+            return len;
+        }
+    }
+    /*  Outside the regions: mapped after its arena's region filled up */
+    for (std::unique_ptr<Arena>& arena : arenas) {
+        if (!arena) {
+            continue;
+        }
+        std::size_t len = arena->usableSize(ptr);
+        if (len) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+std::size_t Melloc::goodSize(std::size_t n) noexcept {
+    return roundup(n);
+}
+
+Melloc::AllocationResult Melloc::allocateAtLeast(std::size_t n) {
+    std::size_t sz = roundup(n);
+    return {allocate(sz), sz};
+}
+
+void Melloc::setSlabPolicy(SlabPolicy policy) noexcept {
+    slabPolicy.store(policy, std::memory_order_relaxed);
+}
+
+/*  Unmap every slab with no live chunks, in every arena */
+std::size_t Melloc::releaseEmptySlabs() noexcept {
+    std::shared_lock readLock(mutMelloc);
+    std::size_t released = 0;
+    for (std::unique_ptr<Arena>& arena : arenas) {
+        if (!arena) {
+            continue;
+        }
+        arena->forEachBin([&](Arena::Bin& b) { released += b.releaseEmptySlabs(); });
+    }
+    return released;
+}
+
+/*  Reserved slabs are prefaulted and pinned in the arena the calling thread
+    allocates from */
+bool Melloc::reserve(std::size_t n, std::size_t count, bool lockPages) {
+    ensureInit();
+    std::size_t sz = roundup(n);
+    if (isLargeSize(sz)) {
+        return false;
+    }
+    std::shared_lock readLock(mutMelloc);
+    return arenas[callerArena(readLock)]->bins[getBinIdx(sz)].reserve(count, lockPages);
+}
+
+void Melloc::enterNoSyscall(bool failAllocations) {
+    {
+        std::shared_lock readLock(mutMelloc);
+        auto threadDescriptorIt = findThreadDescriptor();
+        if (threadDescriptorIt != threadDescriptors.end()) {
+            threadDescriptorIt->second->pausePurge();
+        }
+    }
+    noSyscall = NoSyscallState{true, failAllocations, {}};
+}
+
+Melloc::SyscallReport Melloc::leaveNoSyscall() {
+    SyscallReport report = noSyscall.report;
+    noSyscall = NoSyscallState{};
+    std::shared_lock readLock(mutMelloc);
+    auto threadDescriptorIt = findThreadDescriptor();
+    if (threadDescriptorIt != threadDescriptors.end()) {
+        threadDescriptorIt->second->resumePurge();
+    }
+    return report;
+}
+
+/*  Every cache op runs under a read lock on mutMelloc, so with the write lock
+    held no owner is in the middle of one and the caches, idle threads' too,
+    can be released from here. Threads in no-syscall mode are only asked to,
+    since refilling afterwards could map */
+std::size_t Melloc::reclaim() noexcept {
+    {
+        std::unique_lock writeLock(mutMelloc);
+        for (auto& [tid, tdw] : threadDescriptors) {
+            if (tdw->purgeHeld) {
+                tdw->purgeRequested.store(ThreadDescriptor::ReleasePurge,
+                                          std::memory_order_relaxed);
+            }
+            else {
+                tdw->release();
+            }
+        }
+        for (std::unique_ptr<ThreadDescriptor>& td : explicitCaches) {
+            if (td) {
+                td->release();
+            }
+        }
+#if MELLOC_PERCPU_CACHE
+        flushCpuCaches();
+#endif // MELLOC_PERCPU_CACHE
+        freeThreadDescriptors.clear();
+        freeThreadDescriptors.shrink_to_fit();
+    }
+    std::size_t released = releaseEmptySlabs();
+    MELLOC_PROBE(reclaim, released);
+    return released;
+}
+
+/*  Bytes of [start, start + len) that are faulted in */
+static std::size_t residentBytes(void* start, std::size_t len) noexcept {
+#ifdef __linux__
+    std::array<unsigned char, 256> vec;
+    std::size_t resident = 0;
+    for (std::size_t off = 0; off < len; off += vec.size() * PAGE_SIZE) {
+        std::size_t n = std::min(len - off, vec.size() * PAGE_SIZE);
+        if (mincore(increment(start, off), n, vec.data()) == -1) {
+            return resident;
+        }
+        for (std::size_t i = 0; i * PAGE_SIZE < n; ++i) {
+            resident += (vec[i] & 1) * PAGE_SIZE;
+        }
+    }
+    return resident;
+#else
+    return len;
+#endif // __linux__
+}
+
+/*  Snapshot of memory held by all arenas */
+Melloc::Stats Melloc::getStats() noexcept {
+    std::shared_lock readLock(mutMelloc);
+    Stats stats;
+    stats.byTag = getTagStats();
+    for (std::unique_ptr<Arena>& arena : arenas) {
+        if (!arena) {
+            continue;
+        }
+        arena->forEachBin([&](Arena::Bin& b) {
+            std::unique_lock writeLockBin(b.mutBin);
+            std::size_t sizeClass = smallSizeClasses[b.binIdx];
+            std::size_t freeBytes = 0;
+            for (auto& [slab, info] : b.slabs) {
+                freeBytes += info.nFree * sizeClass;
+            }
+            stats.emptySlabs += b.emptySlabs.size();
+            stats.freeSlabBytes += freeBytes;
+            stats.byLifetime[static_cast<std::size_t>(b.lifetime)].freeSlabBytes += freeBytes;
+        });
+        std::shared_lock readLockArena(arena->mutArena);
+        for (const Arena::PageDescriptor& pd : arena->arenaUsedPages) {
+            LifetimeStats& lifetimeStats = stats.byLifetime[static_cast<std::size_t>(pd.lifetime)];
+            void* start = reinterpret_cast<void*>(pd.page);
+            std::size_t len = pd.isSlab
+                ? pd.sizeInfo.slab.consecutive * PAGE_SIZE
+                : pd.sizeInfo.len;
+            if (pd.isSlab) {
+                ++lifetimeStats.slabs;
+                lifetimeStats.slabBytes += len;
+            }
+            else {
+                ++lifetimeStats.largeObjects;
+                lifetimeStats.largeBytes += len;
+            }
+            lifetimeStats.residentBytes += residentBytes(start, len);
+        }
+    }
+    for (const LifetimeStats& lifetimeStats : stats.byLifetime) {
+        stats.slabs += lifetimeStats.slabs;
+        stats.slabBytes += lifetimeStats.slabBytes;
+        stats.largeObjects += lifetimeStats.largeObjects;
+        stats.largeBytes += lifetimeStats.largeBytes;
+    }
+    return stats;
+}
+
+/*  Allocate count objects of the same size. The thread cache is drained first,
+    and the bin fills the rest with whole runs under one lock */
+void Melloc::allocateBatch(std::size_t n, std::size_t count, void** out) {
+    ensureInit();
+    std::shared_lock readLock(mutMelloc);
+    std::size_t sz = roundup(n);
+    std::size_t done = 0;
+#if MELLOC_PERCPU_CACHE
+    while (done < count && (out[done] = allocatePerCpu(sz))) {
+        ++done;
+    }
+#endif // MELLOC_PERCPU_CACHE
+    if (done < count && !perCpuRefused()) {
+        ThreadDescriptorWrapper& tdw = getThreadDescriptor(readLock);
+        Arena& arena = *arenas[tdw->myArena];
+
+        if (isLargeSize(sz)) {
+            for ( ; done < count; ++done) {
+                out[done] = arena.allocateLarge(sz);
+            }
+        }
+        else {
+            std::size_t binIdx = getBinIdx(sz);
+            done += tdw->popCacheBatch(out + done, count - done, binIdx);
+            if (done < count) {
+                done += arena.bins[binIdx].allocateBatch(out + done, count - done);
+            }
+        }
+    }
+    /* only short if a no-syscall thread was refused a slab */
+    std::fill(out + done, out + count, nullptr);
+    if (threadTag != untagged) {
+        std::size_t got = count - std::count(out, out + count, nullptr);
+        tagAllocated(threadTag, got * sz, got);
+    }
+    if (traceEnabled()) {
+        for (std::size_t i = 0; i < count; ++i) {
+            traceRecord(TraceOp::Allocate, n, out[i]);
+        }
+    }
+}
+
+/*  Free count objects, one arena lookup and one bin lock per slab they came
+    from rather than per object */
+void Melloc::deallocateBatch(void** ptrs, std::size_t count) noexcept {
+    if (threadTag != untagged) {
+        std::size_t bytes = 0;
+        std::size_t freed = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            if (ptrs[i]) {
+                bytes += usableSize(ptrs[i]);
+                ++freed;
+            }
+        }
+        tagFreed(threadTag, bytes, freed);
+    }
+    if (traceEnabled()) {
+        for (std::size_t i = 0; i < count; ++i) {
+            traceRecord(TraceOp::Deallocate, 0, ptrs[i]);
+        }
+    }
+    std::shared_lock readLock(mutMelloc);
+    std::sort(ptrs, ptrs + count, std::less<void*>());
+    auto threadDescriptorIt = findThreadDescriptor();
+    std::size_t myArena = numArenas;
+    ThreadDescriptor* td = nullptr;
+    if (threadDescriptorIt != threadDescriptors.end()) {
+        myArena = threadDescriptorIt->second->myArena;
+        td = threadDescriptorIt->second.get();
+    }
+
+    /* nullptrs, eg. the padding of a short allocateBatch(), sort first */
+    std::size_t i = 0;
+    while (i < count && !ptrs[i]) {
+        ++i;
+    }
+    while (i < count) {
+        std::size_t n = myArena < numArenas
+            ? arenas[myArena]->deallocateRun(ptrs + i, count - i, td)
+            : 0;
+        if (n == 0) {
+            std::size_t owner = regionArena(ptrs[i]);
+            if (owner < numArenas) {
+                n = owner != myArena ? arenas[owner]->deallocateRun(ptrs + i, count - i, nullptr) : 0;
+            }
+            else {
+                for (owner = 0; n == 0 && owner < numArenas; ++owner) {
+                    if (owner != myArena) {
+                        n = arenas[owner]->deallocateRun(ptrs + i, count - i, nullptr);
+                    }
+                }
+            }
+        }
+        if (n == 0) {
+            mellocPrint("ptr 0x%x was not allocated by melloc", ptrs[i]);
+            fatal();
+        }
+        i += n;
+    }
 }
 
-/* Assign arena */
+/*  Counters and current capacities of the calling thread's cache */
+Melloc::ThreadCacheStats Melloc::getThreadCacheStats() noexcept {
+    std::shared_lock readLock(mutMelloc);
+    ThreadCacheStats stats {};
+    auto threadDescriptorIt = findThreadDescriptor();
+    if (threadDescriptorIt == threadDescriptors.end()) {
+        return stats;
+    }
+    ThreadDescriptor* td = threadDescriptorIt->second.get();
+    for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+        stats[i] = td->cacheStats[i];
+        stats[i].capacity = td->capacity[i];
+        stats[i].cached = td->topIdxs[i];
+    }
+    return stats;
+}
+
+Melloc::LockReport Melloc::getLockStats() noexcept {
+    LockReport report;
+#if MELLOC_LOCK_STATS
+    report.melloc = mutMelloc.stats();
+    std::shared_lock readLock(mutMelloc);
+    for (std::unique_ptr<Arena>& arena : arenas) {
+        if (!arena) {
+            continue;
+        }
+        report.arenas += arena->mutArena.stats();
+        arena->forEachBin([&](Arena::Bin& b) { report.bins[b.binIdx] += b.mutBin.stats(); });
+    }
+#endif // MELLOC_LOCK_STATS
+    return report;
+}
+
+void Melloc::resetLockStats() noexcept {
+#if MELLOC_LOCK_STATS
+    std::shared_lock readLock(mutMelloc);
+    mutMelloc.resetStats();
+    for (std::unique_ptr<Arena>& arena : arenas) {
+        if (!arena) {
+            continue;
+        }
+        arena->mutArena.resetStats();
+        arena->forEachBin([](Arena::Bin& b) { b.mutBin.resetStats(); });
+    }
+#endif // MELLOC_LOCK_STATS
+}
+
+void Melloc::setLockStats(bool enabled) noexcept {
+#if MELLOC_LOCK_STATS
+    lockStatsEnabled.store(enabled, std::memory_order_relaxed);
+#else
+    (void)enabled;
+#endif // MELLOC_LOCK_STATS
+}
+
+/*  Create a private arena in the first free slot after the shared arenas */
+[[nodiscard]]
+std::size_t Melloc::createArena() {
+    ensureInit();
+    std::unique_lock writeLock(mutMelloc);
+    for (std::size_t i = numArenas; i < MAX_ARENAS; ++i) {
+        if (!arenas[i]) {
+            arenas[i] = std::make_unique<Arena>(i, true, getCurrentNode());
+            mellocPrint("created private arena %zu", i);
+            return i;
+        }
+    }
+    mellocPrint("out of arenas, MAX_ARENAS is %zu", static_cast<std::size_t>(MAX_ARENAS));
+    fatal();
+}
+
+/* Allocate memory from a private arena */
+[[nodiscard]]
+void* Melloc::allocateIn(std::size_t arena, std::size_t n) {
+    std::shared_lock readLock(mutMelloc);
+    void* out = getPrivateArena(arena).allocate(roundup(n));
+    if (traceEnabled()) {
+        traceRecord(TraceOp::Allocate, n, out);
+    }
+    return out;
+}
+
+/* Free a single object back into its private arena */
+void Melloc::deallocateIn(std::size_t arena, void* ptr) noexcept {
+    if (traceEnabled()) {
+        traceRecord(TraceOp::Deallocate, 0, ptr);
+    }
+    std::shared_lock readLock(mutMelloc);
+    getPrivateArena(arena).deallocateDirect(ptr);
+}
+
+/*  Free everything allocated from a private arena at once. Caller is responsible
+    for not touching any object from the arena afterwards */
+void Melloc::resetArena(std::size_t arena, bool retain) noexcept {
+    std::shared_lock readLock(mutMelloc);
+    getPrivateArena(arena).reset(retain);
+}
+
+/* Free everything in a private arena and release the arena itself */
+void Melloc::destroyArena(std::size_t arena) noexcept {
+    std::unique_lock writeLock(mutMelloc);
+    getPrivateArena(arena).reset(false);
+    arenas[arena]->decommit();
+    arenas[arena].reset();
+    mellocPrint("destroyed private arena %zu", arena);
+}
+
+/*  An extent has to go back through the hooks that handed it out, so hooks
+    can only change while the arena has none */
+bool Melloc::setExtentHooks(std::size_t arena, const ExtentHooks& hooks) {
+    ensureInit();
+    std::shared_lock readLock(mutMelloc);
+    if (arena >= MAX_ARENAS || !arenas[arena]) {
+        mellocPrint("%zu is not an arena", arena);
+        return false;
+    }
+    Arena& a = *arenas[arena];
+    std::unique_lock writeLockArena(a.mutArena);
+    if (!a.arenaUsedPages.empty() || !a.freeExtents.empty() || a.regionTop != a.regionBase) {
+        return false;
+    }
+    a.hooks = hooks;
+    return true;
+}
+
+Melloc::ExtentHooks Melloc::getExtentHooks(std::size_t arena) {
+    ensureInit();
+    std::shared_lock readLock(mutMelloc);
+    if (arena >= MAX_ARENAS || !arenas[arena]) {
+        mellocPrint("%zu is not an arena", arena);
+        fatal();
+    }
+    std::shared_lock readLockArena(arenas[arena]->mutArena);
+    return arenas[arena]->hooks;
+}
+
+/*  Assign arena round-robin among the arenas on the calling thread's node.
+    Arena i lives on node i % numNodes */
 [[nodiscard]]
 size_t Melloc::getArena() noexcept {
-    return 0; // todo: change to rolling counter
+#if MELLOC_SINGLE_THREADED
+    return 0;
+#endif // MELLOC_SINGLE_THREADED
+    std::size_t numNodes = getTopology().numNodes;
+    std::size_t perNode = numArenas / numNodes;
+    std::size_t turn = nextArena.fetch_add(1, std::memory_order_relaxed);
+    return getCurrentNode() + numNodes * (turn % perNode);
 }
 
-/*  return the bin index corresponding to a particular size. */
-std::size_t Melloc::getBinIdx(std::size_t sz) noexcept {
-    std::size_t bin = 0;
-    if (sz <= 8) {
-        return 0;
+/*  Construct the arenas shared by all threads. narenas is rounded up so
+    that every NUMA node gets the same number of arenas */
+void Melloc::initArenas() {
+#if MELLOC_SINGLE_THREADED
+    /*  The one arena lives on the node of the thread that initializes it */
+    numArenas = 1;
+    arenas[0] = std::make_unique<Arena>(0, false, getCurrentNode());
+    return;
+#endif // MELLOC_SINGLE_THREADED
+    std::size_t numNodes = getTopology().numNodes;
+    numArenas = std::min<std::size_t>(
+        MAX_ARENAS / numNodes, (mellocConf.narenas + numNodes - 1) / numNodes) * numNodes;
+
+    for (std::size_t i = 0; i < numArenas; ++i) {
+        arenas[i] = std::make_unique<Arena>(i, false, i % numNodes);
     }
-    if (sz <= 16) {
-        return 1;
+}
+
+/*  One PROT_NONE mapping covers the regions of all MAX_ARENAS slots. It is
+    over-reserved by a region and trimmed, so it starts on a region boundary.
+    MAP_NORESERVE keeps it from counting against overcommit. If it can't be
+    had (eg. under a tight RLIMIT_AS), arenas map every slab on its own */
+void Melloc::reserveHeap() noexcept {
+#ifdef __linux__
+    std::size_t len = MAX_ARENAS * ARENA_REGION_SIZE;
+    void* mem = mmap(/* preferred addr  */ nullptr,
+                     /* size            */ len + ARENA_REGION_SIZE,
+                     /* protect flags   */ PROT_NONE,
+                     /* map flags       */ MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     /* file descriptor */ -1,
+                     /* chunk offset    */ 0);
+    if (mem == MAP_FAILED) {
+        mellocPrint("reserving arena regions failed, mapping slabs one by one");
+        return;
     }
-    if (sz < 192) {
-        bin = 1 + ((sz-16) >> 4); // chunks by 16
-        return bin + !(smallSizeClasses[bin] == sz);
+    std::uintptr_t start = reinterpret_cast<std::uintptr_t>(mem);
+    std::uintptr_t aligned = (start + ARENA_REGION_SIZE - 1) & ~(ARENA_REGION_SIZE - 1);
+    if (aligned > start) {
+        munmap(mem, aligned - start);
     }
-    if (sz < 768) {
-        bin = 9 + ((sz-192) >> 6); // chunks by 64
-        return bin + !(smallSizeClasses[bin] == sz);
+    if (start + ARENA_REGION_SIZE > aligned) {
+        munmap(reinterpret_cast<void*>(aligned + len), start + ARENA_REGION_SIZE - aligned);
     }
-    else {
-        bin = 15 + ((sz-768) >> 8); // chunks by 256
-        return bin + !(smallSizeClasses[bin] == sz);
+    heapBase = aligned;
+#endif // __linux__
+}
+
+/*  The settings are frozen here: slab sizes and cache layouts depend on them */
+void Melloc::initOnce() {
+    std::unique_lock writeLock(mutMelloc);
+    if (initialized.load(std::memory_order_relaxed)) {
+        return;
     }
+    const char* env = std::getenv("MELLOC_CONF");
+    if (env && !parseMellocConf(mellocConf, env)) {
+        mellocPrint("ignored bad pairs in MELLOC_CONF=%s", env);
+    }
+    mellocConf.finalize();
+    reserveHeap();
+    initArenas();
+    initialized.store(true, std::memory_order_release);
+}
+
+/*  Explicit caches sit on the shared arenas, handed out round-robin like
+    threads are */
+Melloc::CacheId Melloc::createCache() {
+    ensureInit();
+    std::unique_lock writeLock(mutMelloc);
+    std::size_t idx = std::find(explicitCaches.begin(), explicitCaches.end(), nullptr)
+        - explicitCaches.begin();
+    if (idx == explicitCaches.size()) {
+        explicitCaches.emplace_back();
+    }
+    explicitCaches[idx] = std::make_unique<ThreadDescriptor>(getArena());
+    return static_cast<CacheId>(idx);
+}
+
+void Melloc::flushCache(CacheId cache) noexcept {
+    std::shared_lock readLock(mutMelloc);
+    getExplicitCache(cache).flush();
+}
+
+void Melloc::destroyCache(CacheId cache) noexcept {
+    std::unique_lock writeLock(mutMelloc);
+    getExplicitCache(cache).flush();
+    explicitCaches[static_cast<std::size_t>(cache)].reset();
+}
+
+void* Melloc::allocate(std::size_t n, CacheId cache) {
+    std::shared_lock readLock(mutMelloc);
+    ThreadDescriptor& td = getExplicitCache(cache);
+    std::size_t sz = roundup(n);
+    void* out = arenas[td.myArena]->allocate(sz, td);
+    if (threadTag != untagged && out) {
+        tagAllocated(threadTag, sz, 1);
+    }
+    if (traceEnabled()) {
+        traceRecord(TraceOp::Allocate, n, out);
+    }
+    return out;
+}
+
+void Melloc::deallocate(void* ptr, CacheId cache) noexcept {
+    if (!ptr) {
+        return;
+    }
+    std::shared_lock readLock(mutMelloc);
+    ThreadDescriptor& td = getExplicitCache(cache);
+    std::size_t binIdx = arenas[td.myArena]->binOf(ptr);
+    if (binIdx == smallSizeClasses.size()) {
+        readLock.unlock();
+        deallocate(ptr);
+        return;
+    }
+    if (threadTag != untagged) {
+        tagFreed(threadTag, smallSizeClasses[binIdx], 1);
+    }
+    if (traceEnabled()) {
+        traceRecord(TraceOp::Deallocate, 0, ptr);
+    }
+    td.pushCache(ptr, binIdx);
+}
+
+Melloc::ThreadDescriptor& Melloc::getExplicitCache(CacheId cache) noexcept {
+    std::size_t idx = static_cast<std::size_t>(cache);
+    if (idx >= explicitCaches.size() || !explicitCaches[idx]) {
+        mellocPrint("%zu is not a live cache", idx);
+        fatal();
+    }
+    return *explicitCaches[idx];
+}
+
+/* Look up a live private arena */
+Melloc::Arena& Melloc::getPrivateArena(std::size_t arena) noexcept {
+    if (arena < numArenas || arena >= MAX_ARENAS || !arenas[arena]) {
+        mellocPrint("%zu is not a private arena", arena);
+        fatal();
+    }
+    return *arenas[arena];
 }
 
 /*  round up to nearest small or large size class. */
@@ -106,12 +764,90 @@ std::size_t Melloc::roundup(std::size_t sz) noexcept {
     return smallSizeClasses[getBinIdx(sz)];
 }
 
+/*  First allocation for a thread assigns its arena via round-robin and
+    initializes its thread cache as well */
+Melloc::ThreadDescriptorWrapper& Melloc::getThreadDescriptor(
+    std::shared_lock<MellocSharedMutex>& readLock) {
+    auto threadDescriptorIt = findThreadDescriptor();
+    if (threadDescriptorIt == threadDescriptors.end()) {
+        readLock.unlock();
+        threadDescriptorIt = acquireThreadDescriptor();
+        readLock.lock();
+    }
+    assert(threadDescriptorIt != threadDescriptors.end());
+    return threadDescriptorIt->second;
+}
+
+std::size_t Melloc::callerArena(std::shared_lock<MellocSharedMutex>& readLock) {
+#if MELLOC_PERCPU_CACHE
+    int cpu = sched_getcpu();
+    if (perCpuUsable() && cpu >= 0 && cpu < MAX_CPUS) {
+        return getCpuArena(cpu);
+    }
+#endif // MELLOC_PERCPU_CACHE
+    return getThreadDescriptor(readLock)->myArena;
+}
+
+/*  Descriptors of exited threads are reused before creating a new one, along
+    with their map node, timer and cache storage */
+Melloc::ThreadDescriptorMap::iterator Melloc::acquireThreadDescriptor() {
+    std::thread::id tid = std::this_thread::get_id();
+    std::unique_lock writeLock(mutMelloc);
+    ThreadDescriptorMap::iterator threadDescriptorIt;
+    if (freeThreadDescriptors.empty()) {
+        threadDescriptorIt = threadDescriptors.emplace(
+            tid, tid /* ThreadDescriptorWrapper(tid) */).first;
+        MELLOC_PROBE(thread_cache_create, threadDescriptorIt->second->myArena, 0);
+    }
+    else {
+        ThreadDescriptorMap::node_type nh = std::move(freeThreadDescriptors.back());
+        freeThreadDescriptors.pop_back();
+        nh.key() = tid;
+        nh.mapped()->attach(tid);
+        threadDescriptorIt = threadDescriptors.insert(std::move(nh)).position;
+        MELLOC_PROBE(thread_cache_create, threadDescriptorIt->second->myArena, 1);
+        mellocPrint("reused thread descriptor, %zu left in pool",
+            freeThreadDescriptors.size());
+    }
+    threadExitHook.registered = true;
+    if (noSyscall.active) {
+        ++noSyscall.report.other;
+        threadDescriptorIt->second->pausePurge();
+    }
+    return threadDescriptorIt;
+}
+
+/*  Called on thread exit. Anything the thread frees after this (eg. from other
+    thread_local destructors) goes straight back to the bins */
+void Melloc::releaseThreadDescriptor() noexcept {
+    std::unique_lock writeLock(mutMelloc);
+    auto threadDescriptorIt = findThreadDescriptor();
+    if (threadDescriptorIt == threadDescriptors.end()) {
+        return;
+    }
+    ThreadDescriptorMap::node_type nh = threadDescriptors.extract(threadDescriptorIt);
+    nh.mapped()->detach();
+    freeThreadDescriptors.push_back(std::move(nh));
+    mellocPrint("thread descriptor returned to pool");
+}
+
+void Melloc::fatal() noexcept {
+    exiting.store(true, std::memory_order_relaxed);
+    std::exit(1);
+}
+
+Melloc::ThreadExitHook::~ThreadExitHook() {
+    if (registered && !exiting.load(std::memory_order_relaxed)) {
+        releaseThreadDescriptor();
+    }
+}
+
 /*  We only want one instance of Melloc per virtual address space, but we cannot make
     Melloc members static, else we are forced to either pollute main file with declarations
     or have undefined global var initialization order (segfault on accessing bad ptr) */
 void Melloc::init() noexcept {
     if (globalInit) {
-        exit(1);
+        fatal();
     }
     globalInit = true;
 }
@@ -121,9 +857,21 @@ void Melloc::init() noexcept {
 #ifndef NDEBUG
 std::mutex                                                  Melloc::mutPrint;
 #endif // NDEBUG
-std::shared_mutex                                           Melloc::mutMelloc; 
-std::array<Melloc::Arena, NUM_ARENAS>                       Melloc::arenas;
-std::unordered_map<std::thread::id,
-                   Melloc::ThreadDescriptorWrapper,
-                   Melloc::ThreadDescriptorWrapper::hash>   Melloc::threadDescriptors;
+MellocSharedMutex                                           Melloc::mutMelloc; 
+std::size_t                                                 Melloc::numArenas {0};
+std::uintptr_t                                              Melloc::heapBase {0};
+MellocAtomic<std::size_t>                                   Melloc::nextArena {0};
+MellocAtomic<Melloc::SlabPolicy>                            Melloc::slabPolicy {SlabPolicy::FullestFirst};
+MellocAtomic<bool>                                          Melloc::initialized {false};
+MellocAtomic<bool>                                          Melloc::exiting {false};
+std::array<std::unique_ptr<Melloc::Arena>, MAX_ARENAS>      Melloc::arenas;
+Melloc::ThreadDescriptorMap                                 Melloc::threadDescriptors;
+std::vector<Melloc::ThreadDescriptorMap::node_type>         Melloc::freeThreadDescriptors;
+std::vector<std::unique_ptr<Melloc::ThreadDescriptor>>      Melloc::explicitCaches;
+thread_local Melloc::ThreadExitHook                         Melloc::threadExitHook;
+thread_local Melloc::NoSyscallState                         Melloc::noSyscall;
+thread_local Melloc::Tag                                    Melloc::threadTag {untagged};
+#if MELLOC_PERCPU_CACHE
+std::array<std::atomic<Melloc::CpuCache*>, MAX_CPUS>        Melloc::cpuCaches {};
+#endif // MELLOC_PERCPU_CACHE
 
@@ -0,0 +1,151 @@
+/**
+ * @file numa.cpp
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief NUMA topology and node-local placement
+ * @version 1.0
+ * @date 2023-10-20
+ *
+ *
+ * Melloc::Topology definitions.
+ *
+ * The topology is read from /sys/devices/system/node the first time an arena
+ * needs it. Shared arenas are spread over the nodes and a thread is assigned an
+ * arena on the node it is running on when it first allocates. Fresh slabs and
+ * large objects are bound to their arena's node with mbind() before they are
+ * touched, so first-touch from a thread on another node can't pull them away.
+ *
+ * Reading sysfs goes through open()/read() into stack buffers, since this runs
+ * during static initialization of the arenas.
+ *
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // __linux__
+
+#include "melloc.h"
+#include "melloc_defs.h"
+#include "melloc_utils.h"
+
+
+#ifdef __linux__
+/*  Read a small sysfs file into buf as a C string. Returns false if missing */
+static bool readSysfs(const char* path, char* buf, std::size_t len) noexcept {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t got = read(fd, buf, len - 1);
+    close(fd);
+    if (got <= 0) {
+        return false;
+    }
+    buf[got] = '\0';
+    return true;
+}
+
+/*  Calls fn on every number in a sysfs list such as "0-3,8,10-11" */
+template <typename Fn>
+static void forEachInList(const char* list, Fn fn) noexcept {
+    const char* c = list;
+    while (*c >= '0' && *c <= '9') {
+        char* end = nullptr;
+        std::size_t lo = std::strtoul(c, &end, 10);
+        std::size_t hi = lo;
+        if (*end == '-') {
+            hi = std::strtoul(end + 1, &end, 10);
+        }
+        for (std::size_t i = lo; i <= hi; ++i) {
+            fn(i);
+        }
+        c = (*end == ',') ? end + 1 : end;
+    }
+}
+#endif // __linux__
+
+Melloc::Topology::Topology() {
+#ifdef __linux__
+    const char* env = std::getenv("MELLOC_NUMA_NODES");
+    if (env && std::atoi(env) > 0) {
+        simulated = true;
+        numNodes = std::min<std::size_t>(std::atoi(env), MAX_NUMA_NODES);
+        for (std::size_t cpu = 0; cpu < MAX_CPUS; ++cpu) {
+            cpuToNode[cpu] = cpu % numNodes;
+        }
+        mellocPrint("simulating %zu NUMA nodes", numNodes);
+        return;
+    }
+
+    char buf[256];
+    if (!readSysfs("/sys/devices/system/node/online", buf, sizeof(buf))) {
+        /* No NUMA support in the kernel, stay single-node */
+        return;
+    }
+    std::size_t maxNode = 0;
+    forEachInList(buf, [&](std::size_t node) {
+        maxNode = std::max(maxNode, node);
+    });
+    numNodes = std::min<std::size_t>(maxNode + 1, MAX_NUMA_NODES);
+
+    for (std::size_t node = 0; node <= maxNode; ++node) {
+        char path[64];
+        std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+        if (!readSysfs(path, buf, sizeof(buf))) {
+            continue;
+        }
+        forEachInList(buf, [&](std::size_t cpu) {
+            if (cpu < MAX_CPUS) {
+                cpuToNode[cpu] = node % numNodes;
+            }
+        });
+    }
+    mellocPrint("found %zu NUMA nodes", numNodes);
+#endif // __linux__
+}
+
+const Melloc::Topology& Melloc::getTopology() noexcept {
+    static const Topology topology;
+    return topology;
+}
+
+/* NUMA node of the cpu the calling thread is running on */
+std::size_t Melloc::getCurrentNode() noexcept {
+    const Topology& topology = getTopology();
+    if (topology.numNodes == 1) {
+        return 0;
+    }
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < MAX_CPUS) {
+        return topology.cpuToNode[cpu];
+    }
+#endif // __linux__
+    return 0;
+}
+
+/*  Set the memory policy of fresh pages before they are first touched. Failure
+    is harmless (the pages just land wherever the kernel puts them), so it is
+    only reported */
+void Melloc::bindToNode(void* addr, std::size_t len, std::size_t node) noexcept {
+#ifdef __linux__
+    const Topology& topology = getTopology();
+    if (topology.numNodes == 1 || topology.simulated) {
+        return;
+    }
+    assert(node < topology.numNodes);
+    unsigned long nodeMask = 1UL << node;
+    int mode = NUMA_STRICT_BIND ? MPOL_BIND : MPOL_PREFERRED;
+    if (syscall(SYS_mbind, addr, len, mode, &nodeMask, sizeof(nodeMask) * 8, 0) == -1) {
+        mellocPrint("mbind of 0x%x to node %zu failed", addr, node);
+    }
+#endif // __linux__
+}
@@ -0,0 +1,335 @@
+/**
+ * @file percpu_cache.cpp
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Per-CPU caches on restartable sequences
+ * @version 1.0
+ * @date 2023-11-20
+ *
+ *
+ * With MELLOC_PERCPU_CACHE, small chunks are cached per CPU rather than per
+ * thread, the way tcmalloc does it. Each CPU has a CpuCache holding chunks of
+ * the shared arena serving that CPU. A push or pop is a short rseq critical
+ * section: it checks that the thread is still on the CPU whose cache it is
+ * using and commits with a single store of the new top. If the thread is
+ * preempted, migrated or signalled inside the section, the kernel sends it to
+ * the abort handler and the op is retried on whatever CPU it is now on. So
+ * there are no locks and no atomic instructions on the cache path.
+ *
+ * Threads that use the per-CPU caches never get a ThreadDescriptor, so a
+ * thread that allocates once and then idles costs nothing beyond its chunks.
+ * The per-CPU caches are bounded by the number of CPUs instead, and are not
+ * purged on a timer.
+ *
+ * The rseq area registered by glibc (2.35+) is used. If there is none, or
+ * registration failed for a thread, that thread falls back to the thread
+ * cache.
+ *
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "melloc.h"
+#include "melloc_defs.h"
+#include "melloc_utils.h"
+
+#if MELLOC_PERCPU_CACHE
+
+#ifdef __has_include
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define MELLOC_HAVE_RSEQ        (1)
+#endif
+#endif
+
+#ifdef MELLOC_HAVE_RSEQ
+
+/*  Result of a critical section */
+enum class RseqResult {
+    Done,
+    Aborted,    /* migrated or preempted, retry */
+    Failed      /* cache full on push, empty on pop */
+};
+
+/*  struct rseq_cs for the section starting at start_ip, in __rseq_cs */
+#define RSEQ_ASM_CS(label, start_ip, post_commit_ip, abort_ip) \
+        ".pushsection __rseq_cs, \"aw\"\n\t" \
+        ".balign 32\n\t" \
+        label ":\n\t" \
+        ".long 0x0, 0x0\n\t" \
+        ".quad " start_ip ", (" post_commit_ip " - " start_ip "), " abort_ip "\n\t" \
+        ".popsection\n\t"
+
+/*  The kernel checks that the 4 bytes before an abort handler are RSEQ_SIG.
+    Handlers live in their own section so the signature is never executed */
+#define RSEQ_ASM_ABORT(label, done_label) \
+        ".pushsection __rseq_failure, \"ax\"\n\t" \
+        ".byte 0x0f, 0xb9, 0x3d\n\t" \
+        ".long 0x53053053\n\t" \
+        label ":\n\t" \
+        "movl %[aborted], %[ret]\n\t" \
+        "jmp " done_label "\n\t" \
+        ".popsection\n\t"
+
+static_assert(RSEQ_SIG == 0x53053053);
+
+/*  Push ptr onto slots if cpu is still current and there is room */
+static inline RseqResult rseqPush(struct rseq* rs, std::uint32_t cpu,
+    std::uint32_t* top, void** slots, std::uint32_t cap, void* ptr) noexcept {
+    int ret;
+    __asm__ __volatile__(
+        RSEQ_ASM_CS("3", "1f", "2f", "4f")
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "movl (%[top]), %%eax\n\t"
+        "cmpl %[cap], %%eax\n\t"
+        "jae 5f\n\t"
+        "movq %[ptr], (%[slots], %%rax, 8)\n\t"
+        "incl %%eax\n\t"
+        "movl %%eax, (%[top])\n\t"      /* commit */
+        "2:\n\t"
+        "movl %[done], %[ret]\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "movl %[failed], %[ret]\n\t"
+        "jmp 6f\n\t"
+        RSEQ_ASM_ABORT("4", "6f")
+        "6:\n\t"
+        : [ret]         "=&r" (ret),
+          [rseq_cs]     "=m" (rs->rseq_cs)
+        : [cpu_id]      "m" (rs->cpu_id),
+          [cpu]         "r" (cpu),
+          [top]         "r" (top),
+          [slots]       "r" (slots),
+          [cap]         "r" (cap),
+          [ptr]         "r" (ptr),
+          [done]        "i" (static_cast<int>(RseqResult::Done)),
+          [aborted]     "i" (static_cast<int>(RseqResult::Aborted)),
+          [failed]      "i" (static_cast<int>(RseqResult::Failed))
+        : "memory", "cc", "rax");
+    return static_cast<RseqResult>(ret);
+}
+
+/*  Pop from slots into out if cpu is still current and there is a chunk */
+static inline RseqResult rseqPop(struct rseq* rs, std::uint32_t cpu,
+    std::uint32_t* top, void** slots, void** out) noexcept {
+    int ret;
+    void* ptr;
+    __asm__ __volatile__(
+        RSEQ_ASM_CS("3", "1f", "2f", "4f")
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "movl (%[top]), %%eax\n\t"
+        "testl %%eax, %%eax\n\t"
+        "jz 5f\n\t"
+        "decl %%eax\n\t"
+        "movq (%[slots], %%rax, 8), %[ptr]\n\t"
+        "movl %%eax, (%[top])\n\t"      /* commit */
+        "2:\n\t"
+        "movl %[done], %[ret]\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "movl %[failed], %[ret]\n\t"
+        "jmp 6f\n\t"
+        RSEQ_ASM_ABORT("4", "6f")
+        "6:\n\t"
+        : [ret]         "=&r" (ret),
+          [ptr]         "=&r" (ptr),
+          [rseq_cs]     "=m" (rs->rseq_cs)
+        : [cpu_id]      "m" (rs->cpu_id),
+          [cpu]         "r" (cpu),
+          [top]         "r" (top),
+          [slots]       "r" (slots),
+          [done]        "i" (static_cast<int>(RseqResult::Done)),
+          [aborted]     "i" (static_cast<int>(RseqResult::Aborted)),
+          [failed]      "i" (static_cast<int>(RseqResult::Failed))
+        : "memory", "cc", "rax");
+    *out = ptr;
+    return static_cast<RseqResult>(ret);
+}
+
+/*  The calling thread's rseq area, or nullptr if it has none */
+static inline struct rseq* rseqArea() noexcept {
+    if (__rseq_size < offsetof(struct rseq, rseq_cs) + sizeof(std::uint64_t)) {
+        return nullptr;
+    }
+    struct rseq* rs = reinterpret_cast<struct rseq*>(
+        static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+    /* negative while unregistered or if registration failed */
+    if (static_cast<std::int32_t>(rs->cpu_id) < 0) {
+        return nullptr;
+    }
+    return rs;
+}
+
+/*  CPU the thread is on right now. Only a hint: the critical sections
+    recheck it */
+static inline std::uint32_t rseqCpu(struct rseq* rs) noexcept {
+    return *static_cast<volatile std::uint32_t*>(&rs->cpu_id_start);
+}
+
+bool Melloc::perCpuUsable() noexcept {
+    struct rseq* rs = rseqArea();
+    return rs && rseqCpu(rs) < MAX_CPUS;
+}
+
+void* Melloc::allocatePerCpu(std::size_t sz, bool* isZeroed) {
+    struct rseq* rs = rseqArea();
+    if (!rs) {
+        return nullptr;
+    }
+    for (;;) {
+        std::uint32_t cpu = rseqCpu(rs);
+        if (cpu >= MAX_CPUS) {
+            return nullptr;
+        }
+        Arena& arena = *arenas[getCpuArena(cpu)];
+        if (isLargeSize(sz)) {
+            return arena.allocateLarge(sz, isZeroed);
+        }
+        if (isZeroed) {
+            *isZeroed = false;
+        }
+
+        std::size_t binIdx = getBinIdx(sz);
+        CpuCache* cache = getCpuCache(cpu);
+        void** slots = cache->slots() + mellocConf.tcacheOffsets[binIdx];
+        void* out = nullptr;
+        switch (rseqPop(rs, cpu, &cache->tops[binIdx], slots, &out)) {
+            case RseqResult::Done:
+                return out;
+            case RseqResult::Aborted:
+                continue;
+            case RseqResult::Failed:
+                break;
+        }
+
+        /*  Empty: take half a cache's worth from the bin and cache the rest.
+            Whatever doesn't fit, or is left after a migration, goes back */
+        std::uint32_t cap = mellocConf.tcacheMaxCapacity[binIdx];
+        std::array<void*, THREAD_CACHE_LIMIT> fill;
+        std::size_t n = arena.bins[binIdx].allocateBatch(
+            fill.data(), std::max<std::size_t>(cap / 2, 1));
+        if (n == 0) {
+            return nullptr;
+        }
+        std::size_t i = 1;
+        while (i < n && rseqPush(rs, cpu, &cache->tops[binIdx], slots, cap, fill[i])
+                        == RseqResult::Done) {
+            ++i;
+        }
+        if (i < n) {
+            arena.bins[binIdx].giveBackBatch(fill.data() + i, n - i);
+        }
+        return fill[0];
+    }
+}
+
+bool Melloc::deallocatePerCpu(void* ptr) noexcept {
+    struct rseq* rs = rseqArea();
+    if (!rs) {
+        return false;
+    }
+    for (;;) {
+        std::uint32_t cpu = rseqCpu(rs);
+        if (cpu >= MAX_CPUS) {
+            return false;
+        }
+        Arena& arena = *arenas[getCpuArena(cpu)];
+        std::size_t binIdx = arena.binOf(ptr);
+        if (binIdx == arena.bins.size()) {
+            return false;
+        }
+
+        CpuCache* cache = getCpuCache(cpu);
+        void** slots = cache->slots() + mellocConf.tcacheOffsets[binIdx];
+        std::uint32_t cap = mellocConf.tcacheMaxCapacity[binIdx];
+        switch (rseqPush(rs, cpu, &cache->tops[binIdx], slots, cap, ptr)) {
+            case RseqResult::Done:
+                return true;
+            case RseqResult::Aborted:
+                continue;
+            case RseqResult::Failed:
+                arena.bins[binIdx].giveBack(ptr);
+                return true;
+        }
+    }
+}
+
+#else
+
+bool Melloc::perCpuUsable() noexcept {
+    return false;
+}
+
+void* Melloc::allocatePerCpu(std::size_t sz, bool* isZeroed) {
+    return nullptr;
+}
+
+bool Melloc::deallocatePerCpu(void* ptr) noexcept {
+    return false;
+}
+
+#endif // MELLOC_HAVE_RSEQ
+
+/*  CPUs are spread over the arenas of their node the same way getArena()
+    spreads threads */
+std::size_t Melloc::getCpuArena(std::size_t cpu) noexcept {
+    const Topology& topology = getTopology();
+    std::size_t perNode = numArenas / topology.numNodes;
+    return topology.cpuToNode[cpu] + topology.numNodes * (cpu % perNode);
+}
+
+Melloc::CpuCache* Melloc::getCpuCache(std::size_t cpu) noexcept {
+    CpuCache* cache = cpuCaches[cpu].load(std::memory_order_acquire);
+    if (cache) {
+        return cache;
+    }
+    void* mem = mmap(/* preferred addr  */ nullptr,
+                     /* size            */ CpuCache::bytes(),
+                     /* protect flags   */ PROT_READ | PROT_WRITE,
+                     /* map flags       */ MAP_PRIVATE | MAP_ANONYMOUS,
+                     /* file descriptor */ 0,
+                     /* chunk offset    */ 0);
+    if (mem == MAP_FAILED) {
+        mellocPrint("mapping cache for cpu %zu failed", cpu);
+        fatal();
+    }
+    bindToNode(mem, CpuCache::bytes(), getTopology().cpuToNode[cpu]);
+    CpuCache* fresh = new (mem) CpuCache;
+    if (!cpuCaches[cpu].compare_exchange_strong(cache, fresh, std::memory_order_acq_rel)) {
+        /* another thread on this cpu got there first */
+        munmap(mem, CpuCache::bytes());
+        return cache;
+    }
+    return fresh;
+}
+
+void Melloc::flushCpuCaches() noexcept {
+    for (std::size_t cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        CpuCache* cache = cpuCaches[cpu].load(std::memory_order_acquire);
+        if (!cache) {
+            continue;
+        }
+        Arena& arena = *arenas[getCpuArena(cpu)];
+        for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+            if (cache->tops[i] > 0) {
+                arena.bins[i].giveBackBatch(cache->slots() + mellocConf.tcacheOffsets[i],
+                                            cache->tops[i]);
+                cache->tops[i] = 0;
+            }
+        }
+    }
+}
+
+#endif // MELLOC_PERCPU_CACHE
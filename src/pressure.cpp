@@ -0,0 +1,280 @@
+/**
+ * @file pressure.cpp
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Reclaiming memory under memory pressure
+ * @version 1.0
+ * @date 2023-11-27
+ *
+ *
+ * The pressure watcher is a thread that sleeps in poll() until either:
+ *
+ *  - the PSI trigger on /proc/pressure/memory fires, ie. tasks stalled on
+ *    memory for longer than stallUs in a windowUs window. If the kernel
+ *    refuses the trigger (unprivileged users need a window that is a multiple
+ *    of 2s) or the file isn't on procfs, "some avg10" is read every pollMs
+ *    instead.
+ *  - pollMs passes, when the cgroup's memory.events "high" count and
+ *    memory.current are checked against the last poll and the soft limit.
+ *
+ * Each pressure event calls Melloc::reclaim() and then the callback.
+ * Pressure that lasts reclaims on every poll, which picks up whatever the
+ * threads cached again since the last one.
+ *
+ * Single-threaded builds have no watcher, since reclaim() would run
+ * concurrently with the allocating thread.
+ *
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#endif // __linux__
+
+#include "melloc.h"
+#include "melloc_defs.h"
+#include "melloc_utils.h"
+
+
+#if defined(__linux__) && !MELLOC_SINGLE_THREADED
+struct PressureWatcher {
+    Melloc::PressureWatch   watch;
+    std::thread             thread;
+    int                     stopFd      {-1};
+    int                     psiFd       {-1};
+    bool                    psiTrigger  {false};
+    std::string             eventsPath;
+    std::string             currentPath;
+    std::size_t             lastHigh    {0};
+    bool                    stopAtExit  {false};
+};
+
+static std::mutex           watcherMut;
+static PressureWatcher      watcher;
+
+/*  Read a small file from the start into buf as a C string */
+static bool readFile(int fd, char* buf, std::size_t len) noexcept {
+    ssize_t got = pread(fd, buf, len - 1, 0);
+    if (got <= 0) {
+        return false;
+    }
+    buf[got] = '\0';
+    return true;
+}
+
+static bool readFile(const std::string& path, char* buf, std::size_t len) noexcept {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = readFile(fd, buf, len);
+    close(fd);
+    return ok;
+}
+
+/*  Value following key (eg. "high ") at the start of a line of buf */
+static std::optional<double> findValue(const char* buf, const char* key) noexcept {
+    std::size_t len = std::strlen(key);
+    for (const char* line = buf; line && *line; ) {
+        if (std::strncmp(line, key, len) == 0) {
+            return std::strtod(line + len, nullptr);
+        }
+        line = std::strchr(line, '\n');
+        line = line ? line + 1 : nullptr;
+    }
+    return std::nullopt;
+}
+
+/*  The process's cgroup v2 directory, from the "0::" line of /proc/self/cgroup */
+static std::string ownCgroupDir() {
+    char buf[1024];
+    if (!readFile(std::string("/proc/self/cgroup"), buf, sizeof(buf))) {
+        return {};
+    }
+    const char* line = std::strstr(buf, "0::");
+    if (!line) {
+        return {};
+    }
+    line += 3;
+    return std::string("/sys/fs/cgroup") + std::string(line, std::strcspn(line, "\n"));
+}
+
+/*  Open the PSI file and try to set a trigger on it */
+static void openPsi(PressureWatcher& w) noexcept {
+    if (!w.watch.psiFile) {
+        return;
+    }
+    struct statfs fs;
+    w.psiFd = open(w.watch.psiFile, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (w.psiFd == -1) {
+        w.psiFd = open(w.watch.psiFile, O_RDONLY | O_CLOEXEC);
+    }
+    if (w.psiFd == -1 || fstatfs(w.psiFd, &fs) == -1 || fs.f_type != PROC_SUPER_MAGIC) {
+        return;
+    }
+    char trigger[64];
+    int len = std::snprintf(trigger, sizeof(trigger), "some %zu %zu",
+                            w.watch.stallUs, w.watch.windowUs);
+    w.psiTrigger = write(w.psiFd, trigger, len + 1) > 0;
+}
+
+/*  Check the watched files after poll() returned, psiFired if the trigger did */
+static std::optional<Melloc::PressureSource> checkPressure(
+    PressureWatcher& w, bool psiFired, std::size_t& current) noexcept {
+    std::optional<Melloc::PressureSource> source;
+    char buf[512];
+    if (psiFired) {
+        source = Melloc::PressureSource::Psi;
+    }
+    else if (w.psiFd != -1 && !w.psiTrigger && readFile(w.psiFd, buf, sizeof(buf))) {
+        std::optional<double> avg10 = findValue(buf, "some avg10=");
+        if (avg10 && *avg10 * w.watch.windowUs >= 100.0 * w.watch.stallUs) {
+            source = Melloc::PressureSource::Psi;
+        }
+    }
+
+    if (!w.eventsPath.empty() && readFile(w.eventsPath, buf, sizeof(buf))) {
+        std::size_t high = findValue(buf, "high ").value_or(0);
+        if (high > w.lastHigh && !source) {
+            source = Melloc::PressureSource::CgroupHigh;
+        }
+        w.lastHigh = high;
+    }
+
+    current = 0;
+    if (!w.currentPath.empty() && readFile(w.currentPath, buf, sizeof(buf))) {
+        current = std::strtoull(buf, nullptr, 10);
+        if (w.watch.softLimit && current > w.watch.softLimit && !source) {
+            source = Melloc::PressureSource::SoftLimit;
+        }
+    }
+    return source;
+}
+
+static void watchLoop() {
+    PressureWatcher& w = watcher;
+    for (;;) {
+        struct pollfd fds[2] = {
+            {w.stopFd, POLLIN, 0},
+            {w.psiTrigger ? w.psiFd : -1, POLLPRI, 0}
+        };
+        if (poll(fds, 2, static_cast<int>(w.watch.pollMs)) == -1 && errno != EINTR) {
+            mellocPrint("pressure watcher poll failed");
+            return;
+        }
+        if (fds[0].revents) {
+            return;
+        }
+        if (fds[1].revents & (POLLERR | POLLNVAL)) {
+            /* the trigger went away (eg. cgroup removed), fall back to reading */
+            w.psiTrigger = false;
+        }
+
+        std::size_t current;
+        std::optional<Melloc::PressureSource> source =
+            checkPressure(w, fds[1].revents & POLLPRI, current);
+        if (!source) {
+            continue;
+        }
+        Melloc::PressureEvent event {*source, current, Melloc::reclaim()};
+        mellocPrint("memory pressure (%d), released %zu bytes",
+            static_cast<int>(event.source), event.released);
+        if (w.watch.callback) {
+            w.watch.callback(event, w.watch.callbackArg);
+        }
+    }
+}
+
+bool Melloc::startPressureWatch(const PressureWatch& watch) {
+    std::unique_lock lock(watcherMut);
+    PressureWatcher& w = watcher;
+    if (w.thread.joinable()) {
+        return false;
+    }
+    w.watch = watch;
+    w.watch.pollMs = std::max<std::size_t>(w.watch.pollMs, 1);
+    w.watch.windowUs = std::max<std::size_t>(w.watch.windowUs, 1);
+    openPsi(w);
+
+    std::string cgroupDir = watch.cgroupDir ? watch.cgroupDir : ownCgroupDir();
+    w.eventsPath.clear();
+    w.currentPath.clear();
+    w.lastHigh = 0;
+    if (!cgroupDir.empty()) {
+        char buf[512];
+        w.eventsPath = cgroupDir + "/memory.events";
+        w.currentPath = cgroupDir + "/memory.current";
+        if (readFile(w.eventsPath, buf, sizeof(buf))) {
+            w.lastHigh = findValue(buf, "high ").value_or(0);
+        }
+        else {
+            w.eventsPath.clear();
+        }
+        if (!readFile(w.currentPath, buf, sizeof(buf))) {
+            w.currentPath.clear();
+        }
+    }
+
+    if (w.psiFd == -1 && w.eventsPath.empty() && w.currentPath.empty()) {
+        mellocPrint("no pressure source to watch");
+        return false;
+    }
+    w.stopFd = eventfd(0, EFD_CLOEXEC);
+    if (w.stopFd == -1) {
+        if (w.psiFd != -1) {
+            close(w.psiFd);
+            w.psiFd = -1;
+        }
+        return false;
+    }
+    w.thread = std::thread(watchLoop);
+    /*  Registered after the arenas were constructed, so the watcher stops
+        before they are destroyed */
+    if (!w.stopAtExit) {
+        w.stopAtExit = std::atexit([] { Melloc::stopPressureWatch(); }) == 0;
+    }
+    return true;
+}
+
+void Melloc::stopPressureWatch() noexcept {
+    std::unique_lock lock(watcherMut);
+    PressureWatcher& w = watcher;
+    if (!w.thread.joinable()) {
+        return;
+    }
+    std::uint64_t one = 1;
+    if (write(w.stopFd, &one, sizeof(one)) != sizeof(one)) {
+        mellocPrint("pressure watcher stop failed");
+    }
+    w.thread.join();
+    close(w.stopFd);
+    w.stopFd = -1;
+    if (w.psiFd != -1) {
+        close(w.psiFd);
+        w.psiFd = -1;
+    }
+    w.psiTrigger = false;
+}
+
+#else
+
+bool Melloc::startPressureWatch(const PressureWatch&) {
+    return false;
+}
+
+void Melloc::stopPressureWatch() noexcept {}
+
+#endif // __linux__ && !MELLOC_SINGLE_THREADED
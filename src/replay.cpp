@@ -0,0 +1,239 @@
+/**
+ * @file replay.cpp
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Replays an allocation trace against melloc or the system malloc
+ * @version 1.0
+ * @date 2023-11-12
+ *
+ *
+ * Usage: melloc_replay <trace file> [--system]
+ *
+ * Records are put back in call order by seq and addresses are turned into
+ * object ids. Every recorded thread gets its own replay thread running its
+ * ops in order. A free waits until the allocation it frees has been replayed,
+ * which may be on another thread, so cross-thread frees keep their order.
+ * Allocated objects get one byte written per page, so resident memory
+ * reflects what the traced program would have touched.
+ *
+ * Fragmentation is reported as the share of the peak resident growth during
+ * replay that was not covered by the peak of live requested bytes.
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#include <unistd.h>
+#endif // __linux__
+
+#include "melloc.h"
+#include "melloc_defs.h"
+#include "melloc_trace.h"
+
+
+/*  A trace record after addresses have been resolved to object ids */
+struct ReplayOp {
+    std::uint32_t   id;
+    std::uint32_t   size;
+    TraceOp         op;
+};
+
+struct Replay {
+    std::vector<std::vector<ReplayOp>>  threads;
+    std::size_t                         numObjects  {0};
+    std::size_t                         numOps      {0};
+    std::size_t                         peakLive    {0};    /* requested bytes */
+    std::uint64_t                       duration    {0};    /* ns, as captured */
+};
+
+static bool loadTrace(const char* path, std::vector<TraceRecord>& records) {
+    std::FILE* f = std::fopen(path, "rb");
+    if (!f) {
+        std::fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    TraceHeader header;
+    if (std::fread(&header, sizeof(header), 1, f) != 1
+        || std::memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION
+        || header.recordSize != sizeof(TraceRecord)) {
+        std::fprintf(stderr, "%s is not a melloc trace\n", path);
+        std::fclose(f);
+        return false;
+    }
+    TraceRecord rec;
+    while (std::fread(&rec, sizeof(rec), 1, f) == 1) {
+        records.push_back(rec);
+    }
+    std::fclose(f);
+    return true;
+}
+
+/*  Sort records into call order and give every allocation an id. Frees of
+    addresses with no recorded allocation are dropped */
+static Replay buildReplay(std::vector<TraceRecord>& records) {
+    std::sort(records.begin(), records.end(),
+        [](const TraceRecord& a, const TraceRecord& b) { return a.seq < b.seq; });
+
+    Replay replay;
+    std::unordered_map<std::uint64_t, std::uint32_t> live;
+    std::vector<std::uint32_t> sizes;
+    std::size_t liveBytes = 0;
+    for (const TraceRecord& rec : records) {
+        if (rec.thread >= replay.threads.size()) {
+            replay.threads.resize(rec.thread + 1);
+        }
+        replay.duration = std::max(replay.duration, rec.timestamp);
+        if (rec.op == TraceOp::Deallocate) {
+            auto liveIt = live.find(rec.ptr);
+            if (liveIt == live.end()) {
+                continue;
+            }
+            std::uint32_t id = liveIt->second;
+            live.erase(liveIt);
+            liveBytes -= sizes[id];
+            replay.threads[rec.thread].push_back({id, 0, rec.op});
+        }
+        else {
+            std::uint32_t id = static_cast<std::uint32_t>(sizes.size());
+            sizes.push_back(rec.size);
+            live[rec.ptr] = id;
+            liveBytes += rec.size;
+            replay.peakLive = std::max(replay.peakLive, liveBytes);
+            replay.threads[rec.thread].push_back({id, rec.size, rec.op});
+        }
+        ++replay.numOps;
+    }
+    replay.numObjects = sizes.size();
+    return replay;
+}
+
+/*  Resident bytes of this process, 0 if unknown */
+static std::size_t residentBytes() {
+#ifdef __linux__
+    std::FILE* f = std::fopen("/proc/self/statm", "r");
+    if (!f) {
+        return 0;
+    }
+    std::size_t total = 0;
+    std::size_t resident = 0;
+    int got = std::fscanf(f, "%zu %zu", &total, &resident);
+    std::fclose(f);
+    return got == 2 ? resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif // __linux__
+}
+
+static void* replayAllocate(const ReplayOp& op, bool useSystem) {
+    std::size_t n = std::max<std::size_t>(op.size, 1);
+    if (useSystem) {
+        return op.op == TraceOp::AllocateZeroed ? std::calloc(1, n) : std::malloc(n);
+    }
+    return op.op == TraceOp::AllocateZeroed ? Melloc::allocateZeroed(n)
+                                            : Melloc::allocate(n);
+}
+
+static void replayThread(const std::vector<ReplayOp>& ops,
+                         std::atomic<void*>* objects, bool useSystem) {
+    for (const ReplayOp& op : ops) {
+        if (op.op == TraceOp::Deallocate) {
+            void* ptr;
+            while (!(ptr = objects[op.id].load(std::memory_order_acquire))) {
+                std::this_thread::yield();
+            }
+            if (useSystem) {
+                std::free(ptr);
+            }
+            else {
+                Melloc::deallocate(ptr);
+            }
+            continue;
+        }
+        char* ptr = static_cast<char*>(replayAllocate(op, useSystem));
+        for (std::size_t off = 0; off < op.size; off += PAGE_SIZE) {
+            ptr[off] = 1;
+        }
+        objects[op.id].store(ptr, std::memory_order_release);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <trace file> [--system]\n", argv[0]);
+        return 1;
+    }
+    bool useSystem = argc > 2 && std::strcmp(argv[2], "--system") == 0;
+
+    std::vector<TraceRecord> records;
+    if (!loadTrace(argv[1], records)) {
+        return 1;
+    }
+    Replay replay = buildReplay(records);
+    records = std::vector<TraceRecord>();
+#if MELLOC_SINGLE_THREADED
+    if (!useSystem && replay.threads.size() > 1) {
+        std::fprintf(stderr, "melloc was built single-threaded, cannot replay %zu threads\n",
+                     replay.threads.size());
+        return 1;
+    }
+#endif // MELLOC_SINGLE_THREADED
+    std::unique_ptr<std::atomic<void*>[]> objects(
+        new std::atomic<void*>[replay.numObjects]());
+
+    Melloc alloc;
+    std::size_t baseRss = residentBytes();
+    std::atomic<std::size_t> peakRss {baseRss};
+    std::atomic<bool> done {false};
+    std::thread sampler([&]() {
+        while (!done.load(std::memory_order_relaxed)) {
+            peakRss.store(std::max(peakRss.load(), residentBytes()));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (const std::vector<ReplayOp>& ops : replay.threads) {
+        workers.emplace_back(replayThread, std::cref(ops), objects.get(), useSystem);
+    }
+    for (std::thread& t : workers) {
+        t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    done = true;
+    sampler.join();
+    peakRss.store(std::max(peakRss.load(), residentBytes()));
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::size_t rssGrowth = peakRss.load() - baseRss;
+    std::printf("allocator:       %s\n", useSystem ? "system malloc" : "melloc");
+    std::printf("threads:         %zu\n", replay.threads.size());
+    std::printf("ops:             %zu\n", replay.numOps);
+    std::printf("captured over:   %.3f s\n", replay.duration / 1e9);
+    std::printf("replay time:     %.3f s (%.0f ops/s)\n", seconds, replay.numOps / seconds);
+    std::printf("peak live:       %zu bytes\n", replay.peakLive);
+    std::printf("peak RSS growth: %zu bytes\n", rssGrowth);
+    if (rssGrowth > replay.peakLive) {
+        std::printf("fragmentation:   %.1f%%\n",
+            100.0 * (rssGrowth - replay.peakLive) / rssGrowth);
+    }
+    else {
+        std::printf("fragmentation:   0.0%%\n");
+    }
+    if (!useSystem) {
+        Melloc::Stats stats = Melloc::getStats();
+        std::printf("slabs:           %zu (%zu empty), %zu of %zu bytes free\n",
+            stats.slabs, stats.emptySlabs, stats.freeSlabBytes, stats.slabBytes);
+    }
+    return 0;
+}
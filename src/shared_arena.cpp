@@ -0,0 +1,496 @@
+/**
+ * @file shared_arena.cpp
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Arenas in shared memory or a file
+ * @version 1.0
+ * @date 2023-12-04
+ *
+ *
+ * The mapping is laid out as
+ *
+ *      | header | page map | data pages ... top | untouched ... |
+ *
+ * The header holds the lock, the bump pointer top, the list of free page runs
+ * and a free list per small size class. The page map has one entry per data
+ * page: every page of a slab is marked with its bin index, the first page of a
+ * large object with its length, and the first and last pages of a free run
+ * with the run's length. Free runs and free chunks are linked through their
+ * own first bytes. All links are offsets from the start of the mapping, so
+ * nothing in it depends on where a process mapped it.
+ *
+ * Slabs are carved the same size as in a normal arena but are never given
+ * back, the same way the bins of a normal arena keep their slabs until asked.
+ * Freed large objects are merged with their free neighbours, and a run that
+ * ends at top lowers top instead.
+ *
+ * The lock is a process-shared robust mutex. If a process dies holding it the
+ * next locker takes it over, but whatever the dead process was in the middle
+ * of is not repaired. A file opened by open() has its lock reset when no other
+ * process has it open, so a lock left held by a crashed run doesn't survive
+ * into the next one.
+ *
+ */
+
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#ifdef __linux__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // __linux__
+
+#include "melloc.h"
+#include "melloc_defs.h"
+#include "melloc_shared.h"
+#include "melloc_utils.h"
+
+#ifdef __linux__
+
+/*  Page map entries. The top two bits are the kind, the rest a bin index or a
+    number of pages. Pages above top and inside runs are 0 */
+#define SHARED_PAGE_KIND_SHIFT  (30U)
+#define SHARED_PAGE_COUNT_MASK  ((1U << SHARED_PAGE_KIND_SHIFT) - 1)
+#define SHARED_PAGE_SLAB        (1U << SHARED_PAGE_KIND_SHIFT)
+#define SHARED_PAGE_LARGE       (2U << SHARED_PAGE_KIND_SHIFT)
+#define SHARED_PAGE_FREE        (3U << SHARED_PAGE_KIND_SHIFT)
+
+using Offset = SharedArena::Offset;
+
+struct SharedArenaHeader {
+    char                                            magic[8];
+    std::uint32_t                                   version;
+    std::uint32_t                                   pageSize;
+    std::uint32_t                                   numSizeClasses;
+    std::uint64_t                                   size;
+    Offset                                          mapStart;
+    Offset                                          dataStart;
+    Offset                                          top;
+    Offset                                          root;
+    Offset                                          freeRuns;
+    std::array<Offset, smallSizeClasses.size()>     freeChunks;
+    pthread_mutex_t                                 mut;
+};
+
+static_assert(sizeof(SharedArenaHeader) <= PAGE_SIZE);
+
+/*  Links at the start of a free run */
+struct SharedFreeRun {
+    Offset          next;
+    Offset          prev;
+};
+
+static inline std::uint32_t pageKind(std::uint32_t entry) noexcept {
+    return entry & ~SHARED_PAGE_COUNT_MASK;
+}
+
+static inline std::uint32_t pageCount(std::uint32_t entry) noexcept {
+    return entry & SHARED_PAGE_COUNT_MASK;
+}
+
+std::unique_ptr<SharedArena> SharedArena::open(const char* path, std::size_t size) {
+    int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        mellocPrint("opening shared arena %s failed", path);
+        return nullptr;
+    }
+    /*  Every process mapping the file holds a shared flock. Getting it
+        exclusively means nobody else has it open, so it is safe to format it
+        or reset its lock before going shared */
+    bool alone = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (!alone && flock(fd, LOCK_SH) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    bool fresh = alone && st.st_size == 0;
+    std::size_t len = st.st_size;
+    if (fresh) {
+        len = (size & PAGE_MASK) + PAGE_SIZE * isOffPage(size);
+        if (ftruncate(fd, len) != 0) {
+            close(fd);
+            return nullptr;
+        }
+    }
+    std::unique_ptr<SharedArena> arena = map(fd, len, fresh);
+    if (!arena) {
+        close(fd);
+        return nullptr;
+    }
+    if (alone) {
+        if (!fresh) {
+            /* a robust mutex can't be recovered from a dead run's state */
+            arena->initLock();
+        }
+        flock(fd, LOCK_SH);
+    }
+    return arena;
+}
+
+std::unique_ptr<SharedArena> SharedArena::create(std::size_t size) {
+    int fd = memfd_create("melloc_shared", MFD_CLOEXEC);
+    if (fd < 0) {
+        mellocPrint("memfd_create failed");
+        return nullptr;
+    }
+    std::size_t len = (size & PAGE_MASK) + PAGE_SIZE * isOffPage(size);
+    if (ftruncate(fd, len) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    std::unique_ptr<SharedArena> arena = map(fd, len, true);
+    if (!arena) {
+        close(fd);
+    }
+    return arena;
+}
+
+std::unique_ptr<SharedArena> SharedArena::openFd(int fd) {
+    int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(own, &st) != 0) {
+        close(own);
+        return nullptr;
+    }
+    std::unique_ptr<SharedArena> arena = map(own, st.st_size, false);
+    if (!arena) {
+        close(own);
+    }
+    return arena;
+}
+
+std::unique_ptr<SharedArena> SharedArena::map(int fd, std::size_t len, bool fresh) {
+    if (len < sizeof(SharedArenaHeader) || len % PAGE_SIZE != 0) {
+        mellocPrint("shared arena of %zu bytes is too small or not whole pages", len);
+        return nullptr;
+    }
+    void* mem = mmap(/* preferred addr  */ nullptr,
+                     /* size            */ len,
+                     /* protect flags   */ PROT_READ | PROT_WRITE,
+                     /* map flags       */ MAP_SHARED,
+                     /* file descriptor */ fd,
+                     /* chunk offset    */ 0);
+    if (mem == MAP_FAILED) {
+        mellocPrint("mapping shared arena of %zu bytes failed", len);
+        return nullptr;
+    }
+    std::unique_ptr<SharedArena> arena(new SharedArena(fd, static_cast<char*>(mem), len));
+    if (fresh) {
+        arena->format();
+    }
+    if (!arena->validate()) {
+        mellocPrint("not a shared arena of this build");
+        arena->fileFd = -1;     /* caller closes it */
+        return nullptr;
+    }
+    return arena;
+}
+
+SharedArena::SharedArena(int fd, char* base, std::size_t len)
+    : base(base), len(len), fileFd(fd) {}
+
+SharedArena::~SharedArena() {
+    munmap(base, len);
+    if (fileFd >= 0) {
+        close(fileFd);
+    }
+}
+
+void SharedArena::format() noexcept {
+    std::size_t numPages = len / PAGE_SIZE;
+    std::size_t mapBytes = numPages * sizeof(std::uint32_t);
+    mapBytes = (mapBytes & PAGE_MASK) + PAGE_SIZE * isOffPage(mapBytes);
+
+    SharedArenaHeader* head = header();
+    std::memset(head->magic, 0, sizeof(head->magic));
+    head->version = SHARED_ARENA_VERSION;
+    head->pageSize = PAGE_SIZE;
+    head->numSizeClasses = smallSizeClasses.size();
+    head->size = len;
+    head->mapStart = PAGE_SIZE;
+    head->dataStart = PAGE_SIZE + mapBytes;
+    head->top = head->dataStart;
+    head->root = 0;
+    head->freeRuns = 0;
+    head->freeChunks.fill(0);
+    std::memset(base + head->mapStart, 0, mapBytes);
+    initLock();
+
+    /* magic goes last, so a half formatted file never validates */
+    std::memcpy(head->magic, SHARED_ARENA_MAGIC, sizeof(head->magic));
+}
+
+void SharedArena::initLock() noexcept {
+    SharedArenaHeader* head = header();
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&head->mut, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+bool SharedArena::validate() const noexcept {
+    const SharedArenaHeader* head = header();
+    return std::memcmp(head->magic, SHARED_ARENA_MAGIC, sizeof(head->magic)) == 0
+        && head->version == SHARED_ARENA_VERSION
+        && head->pageSize == PAGE_SIZE
+        && head->numSizeClasses == smallSizeClasses.size()
+        && head->size == len
+        && head->dataStart <= len
+        && head->top >= head->dataStart && head->top <= len;
+}
+
+inline std::uint32_t& SharedArena::pageEntry(Offset off) const noexcept {
+    std::uint32_t* map = reinterpret_cast<std::uint32_t*>(base + header()->mapStart);
+    return map[(off - header()->dataStart) / PAGE_SIZE];
+}
+
+void SharedArena::lock() noexcept {
+    if (pthread_mutex_lock(&header()->mut) == EOWNERDEAD) {
+        mellocPrint("shared arena lock owner died, taking over");
+        pthread_mutex_consistent(&header()->mut);
+    }
+}
+
+void SharedArena::unlock() noexcept {
+    pthread_mutex_unlock(&header()->mut);
+}
+
+void* SharedArena::allocate(std::size_t n) {
+    if (n == 0) {
+        n = 1;
+    }
+    SharedArenaHeader* head = header();
+    lock();
+    void* out = nullptr;
+    if (!isLargeSize(n)) {
+        std::size_t binIdx = sizeClassLookup[sizeClassLookupIdx(n)];
+        if (head->freeChunks[binIdx] || refill(binIdx)) {
+            Offset chunk = head->freeChunks[binIdx];
+            head->freeChunks[binIdx] = link(chunk);
+            out = base + chunk;
+        }
+    }
+    else {
+        std::size_t npages = n / PAGE_SIZE + isOffPage(n);
+        Offset off = npages <= SHARED_PAGE_COUNT_MASK ? takePages(npages) : 0;
+        if (off) {
+            pageEntry(off) = SHARED_PAGE_LARGE | npages;
+            out = base + off;
+        }
+    }
+    unlock();
+    return out;
+}
+
+void SharedArena::deallocate(void* ptr) noexcept {
+    if (!ptr) {
+        return;
+    }
+    assert(owns(ptr));
+    SharedArenaHeader* head = header();
+    Offset off = toOffset(ptr);
+    lock();
+    std::uint32_t entry = pageEntry(off);
+    if (pageKind(entry) == SHARED_PAGE_SLAB) {
+        std::size_t binIdx = pageCount(entry);
+        link(off) = head->freeChunks[binIdx];
+        head->freeChunks[binIdx] = off;
+    }
+    else {
+        assert(pageKind(entry) == SHARED_PAGE_LARGE && off % PAGE_SIZE == 0);
+        freePages(off, pageCount(entry));
+    }
+    unlock();
+}
+
+bool SharedArena::refill(std::size_t binIdx) noexcept {
+    std::size_t sizeClass = smallSizeClasses[binIdx];
+    std::size_t slabSize = getSlabSize(sizeClass);
+    Offset slab = takePages(slabSize / PAGE_SIZE);
+    if (!slab) {
+        return false;
+    }
+    for (std::size_t i = 0; i < slabSize; i += PAGE_SIZE) {
+        pageEntry(slab + i) = SHARED_PAGE_SLAB | binIdx;
+    }
+    /* threaded back to front so chunks come out in address order */
+    SharedArenaHeader* head = header();
+    std::size_t numObjs = slabSize / sizeClass;
+    for (std::size_t i = numObjs; i-- > 0;) {
+        Offset chunk = slab + i * sizeClass;
+        link(chunk) = head->freeChunks[binIdx];
+        head->freeChunks[binIdx] = chunk;
+    }
+    return true;
+}
+
+Offset SharedArena::takePages(std::size_t npages) noexcept {
+    SharedArenaHeader* head = header();
+    for (Offset run = head->freeRuns; run; ) {
+        SharedFreeRun* links = reinterpret_cast<SharedFreeRun*>(base + run);
+        std::size_t runPages = pageCount(pageEntry(run));
+        if (runPages < npages) {
+            run = links->next;
+            continue;
+        }
+        Offset next = links->next;
+        Offset prev = links->prev;
+        pageEntry(run + (runPages - 1) * PAGE_SIZE) = 0;
+        pageEntry(run) = 0;
+        if (runPages == npages) {
+            if (prev) {
+                reinterpret_cast<SharedFreeRun*>(base + prev)->next = next;
+            }
+            else {
+                head->freeRuns = next;
+            }
+            if (next) {
+                reinterpret_cast<SharedFreeRun*>(base + next)->prev = prev;
+            }
+        }
+        else {
+            /* the tail stays a free run in the same place in the list */
+            Offset rest = run + npages * PAGE_SIZE;
+            std::size_t restPages = runPages - npages;
+            *reinterpret_cast<SharedFreeRun*>(base + rest) = {next, prev};
+            if (prev) {
+                reinterpret_cast<SharedFreeRun*>(base + prev)->next = rest;
+            }
+            else {
+                head->freeRuns = rest;
+            }
+            if (next) {
+                reinterpret_cast<SharedFreeRun*>(base + next)->prev = rest;
+            }
+            pageEntry(rest) = SHARED_PAGE_FREE | restPages;
+            pageEntry(rest + (restPages - 1) * PAGE_SIZE) = SHARED_PAGE_FREE | restPages;
+        }
+        return run;
+    }
+    if (npages > (len - head->top) / PAGE_SIZE) {
+        return 0;
+    }
+    Offset off = head->top;
+    head->top += npages * PAGE_SIZE;
+    return off;
+}
+
+/*  Unlink a free run from the run list */
+static void unlinkRun(char* base, SharedArenaHeader* head, Offset run) noexcept {
+    SharedFreeRun* links = reinterpret_cast<SharedFreeRun*>(base + run);
+    if (links->prev) {
+        reinterpret_cast<SharedFreeRun*>(base + links->prev)->next = links->next;
+    }
+    else {
+        head->freeRuns = links->next;
+    }
+    if (links->next) {
+        reinterpret_cast<SharedFreeRun*>(base + links->next)->prev = links->prev;
+    }
+}
+
+void SharedArena::freePages(Offset off, std::size_t npages) noexcept {
+    SharedArenaHeader* head = header();
+    pageEntry(off) = 0;
+
+    /* merge with the run just before, found by its last page */
+    if (off > head->dataStart) {
+        std::uint32_t before = pageEntry(off - PAGE_SIZE);
+        if (pageKind(before) == SHARED_PAGE_FREE) {
+            std::size_t beforePages = pageCount(before);
+            Offset run = off - beforePages * PAGE_SIZE;
+            unlinkRun(base, head, run);
+            pageEntry(run) = 0;
+            pageEntry(off - PAGE_SIZE) = 0;
+            off = run;
+            npages += beforePages;
+        }
+    }
+
+    Offset end = off + npages * PAGE_SIZE;
+    if (end == head->top) {
+        head->top = off;
+        return;
+    }
+
+    /* and with the run just after, found by its first page */
+    std::uint32_t after = pageEntry(end);
+    if (pageKind(after) == SHARED_PAGE_FREE) {
+        std::size_t afterPages = pageCount(after);
+        unlinkRun(base, head, end);
+        pageEntry(end) = 0;
+        pageEntry(end + (afterPages - 1) * PAGE_SIZE) = 0;
+        npages += afterPages;
+    }
+
+    *reinterpret_cast<SharedFreeRun*>(base + off) = {head->freeRuns, 0};
+    if (head->freeRuns) {
+        reinterpret_cast<SharedFreeRun*>(base + head->freeRuns)->prev = off;
+    }
+    head->freeRuns = off;
+    pageEntry(off) = SHARED_PAGE_FREE | npages;
+    pageEntry(off + (npages - 1) * PAGE_SIZE) = SHARED_PAGE_FREE | npages;
+}
+
+void SharedArena::setRoot(Offset off) noexcept {
+    __atomic_store_n(&header()->root, off, __ATOMIC_RELEASE);
+}
+
+Offset SharedArena::getRoot() const noexcept {
+    return __atomic_load_n(&header()->root, __ATOMIC_ACQUIRE);
+}
+
+bool SharedArena::sync() noexcept {
+    return msync(base, len, MS_SYNC) == 0;
+}
+
+#else
+
+std::unique_ptr<SharedArena> SharedArena::open(const char* path, std::size_t size) {
+    return nullptr;
+}
+
+std::unique_ptr<SharedArena> SharedArena::create(std::size_t size) {
+    return nullptr;
+}
+
+std::unique_ptr<SharedArena> SharedArena::openFd(int fd) {
+    return nullptr;
+}
+
+SharedArena::~SharedArena() {}
+
+void* SharedArena::allocate(std::size_t n) {
+    return nullptr;
+}
+
+void SharedArena::deallocate(void* ptr) noexcept {}
+
+void SharedArena::setRoot(Offset off) noexcept {}
+
+SharedArena::Offset SharedArena::getRoot() const noexcept {
+    return 0;
+}
+
+bool SharedArena::sync() noexcept {
+    return false;
+}
+
+#endif // __linux__
@@ -0,0 +1,133 @@
+/**
+ * @file tags.cpp
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Per-tag memory accounting
+ * @version 1.0
+ * @date 2023-12-06
+ *
+ *
+ * Every thread that allocates or frees under a tag gets a TagCounters of its
+ * own, so counting takes no lock and no atomic read-modify-write: only the
+ * owner writes its counters, and getTagStats() reads them with relaxed loads.
+ * When a thread exits its counters are folded into tagRetired. Objects carry
+ * no header, so a free is charged the size class it was allocated with, taken
+ * from the size passed to a sized free or else looked up.
+ *
+ */
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#include "melloc.h"
+#include "melloc_defs.h"
+#include "melloc_utils.h"
+
+
+struct TagCounters {
+    TagCounters();
+
+    ~TagCounters();
+
+    /*  Only the owning thread calls this */
+    template <typename T>
+    static inline void add(MellocAtomic<T>& counter, T n) noexcept {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    std::array<MellocAtomic<std::int64_t>, MAX_TAGS>    liveBytes       {};
+    std::array<MellocAtomic<std::int64_t>, MAX_TAGS>    liveObjects     {};
+    std::array<MellocAtomic<std::uint64_t>, MAX_TAGS>   allocations     {};
+    std::array<MellocAtomic<std::uint64_t>, MAX_TAGS>   deallocations   {};
+};
+
+static MellocMutex                                  tagMut;
+static std::vector<TagCounters*>                    tagThreads;
+static std::array<Melloc::TagStats, MAX_TAGS>       tagRetired {};
+/*  Set once the thread's counters are destroyed, so frees from later
+    thread_local destructors are charged to tagRetired instead */
+static thread_local bool                            tagCountersGone {false};
+
+TagCounters::TagCounters() {
+    std::unique_lock writeLock(tagMut);
+    tagThreads.push_back(this);
+}
+
+TagCounters::~TagCounters() {
+    std::unique_lock writeLock(tagMut);
+    for (std::size_t tag = 0; tag < MAX_TAGS; ++tag) {
+        tagRetired[tag].liveBytes += liveBytes[tag].load(std::memory_order_relaxed);
+        tagRetired[tag].liveObjects += liveObjects[tag].load(std::memory_order_relaxed);
+        tagRetired[tag].allocations += allocations[tag].load(std::memory_order_relaxed);
+        tagRetired[tag].deallocations += deallocations[tag].load(std::memory_order_relaxed);
+    }
+    std::erase(tagThreads, this);
+    tagCountersGone = true;
+}
+
+/*  Counters of the calling thread, or nullptr once they are gone */
+static inline TagCounters* threadTagCounters() noexcept {
+    if (tagCountersGone) {
+        return nullptr;
+    }
+    thread_local TagCounters counters;
+    return &counters;
+}
+
+Melloc::TagScope::TagScope(Tag tag) noexcept : previous(threadTag) {
+    if (tag >= MAX_TAGS) {
+        mellocPrint("tag %u is not below MAX_TAGS", tag);
+        fatal();
+    }
+    threadTag = tag;
+}
+
+Melloc::TagScope::~TagScope() {
+    threadTag = previous;
+}
+
+void Melloc::tagAllocated(Tag tag, std::size_t bytes, std::size_t count) noexcept {
+    TagCounters* counters = threadTagCounters();
+    if (!counters) {
+        std::unique_lock writeLock(tagMut);
+        tagRetired[tag].liveBytes += bytes;
+        tagRetired[tag].liveObjects += count;
+        tagRetired[tag].allocations += count;
+        return;
+    }
+    TagCounters::add<std::int64_t>(counters->liveBytes[tag], bytes);
+    TagCounters::add<std::int64_t>(counters->liveObjects[tag], count);
+    TagCounters::add<std::uint64_t>(counters->allocations[tag], count);
+}
+
+void Melloc::tagFreed(Tag tag, std::size_t bytes, std::size_t count) noexcept {
+    TagCounters* counters = threadTagCounters();
+    if (!counters) {
+        std::unique_lock writeLock(tagMut);
+        tagRetired[tag].liveBytes -= bytes;
+        tagRetired[tag].liveObjects -= count;
+        tagRetired[tag].deallocations += count;
+        return;
+    }
+    TagCounters::add<std::int64_t>(counters->liveBytes[tag], -static_cast<std::int64_t>(bytes));
+    TagCounters::add<std::int64_t>(counters->liveObjects[tag], -static_cast<std::int64_t>(count));
+    TagCounters::add<std::uint64_t>(counters->deallocations[tag], count);
+}
+
+std::array<Melloc::TagStats, MAX_TAGS> Melloc::getTagStats() noexcept {
+    std::unique_lock writeLock(tagMut);
+    std::array<TagStats, MAX_TAGS> stats = tagRetired;
+    for (TagCounters* counters : tagThreads) {
+        for (std::size_t tag = 0; tag < MAX_TAGS; ++tag) {
+            stats[tag].liveBytes += counters->liveBytes[tag].load(std::memory_order_relaxed);
+            stats[tag].liveObjects += counters->liveObjects[tag].load(std::memory_order_relaxed);
+            stats[tag].allocations += counters->allocations[tag].load(std::memory_order_relaxed);
+            stats[tag].deallocations += counters->deallocations[tag].load(std::memory_order_relaxed);
+        }
+    }
+    return stats;
+}
@@ -10,141 +10,313 @@
  * Melloc::ThreadDescriptor definitions.
  * 
  * A ThreadDescriptor is created the first time a thread requests an 
- * allocation. It remains till the thread is terminated (todo: this.)
+ * allocation. When the thread exits, its cache is flushed back to the bins,
+ * its purge timer is deleted, and the descriptor is parked in a free pool
+ * to be attached to the next new thread.
+ *
+ * Only the owning thread touches its cache during a cache op. The purge
+ * timer signals that thread, and the handler just raises purgeRequested; the
+ * purge itself runs at the start of the owner's next cache op. Cache ops run
+ * under a read lock on mutMelloc, so Melloc::reclaim() releases every cache
+ * directly under the write lock, idle threads' included.
  *
  *
  *
  */
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <iostream>
 #include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <utility>
 
-#include "atomic_guard.h"
 #include "melloc.h"
 #include "melloc_defs.h"
+#include "melloc_probes.h"
 #include "melloc_utils.h"
 
 
-using BinCache = std::array<void*, THREAD_CACHE_SIZE>;
-
 #ifdef __linux__
-/*  Signal handler for timer which calls purge() */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*  Signal handler for timer. Runs on the owning thread, possibly in the
+    middle of a cache op or holding a bin lock, so it only leaves a request */
 void threadDescriptorSignalHandler(int sig, siginfo_t* si, void* uc) {
     Melloc::ThreadDescriptor* ptr = static_cast<Melloc::ThreadDescriptor*>(
         si->si_value.sival_ptr);
-    ptr->purge();
+    std::uint8_t none = Melloc::ThreadDescriptor::NoPurge;
+    ptr->purgeRequested.compare_exchange_strong(none, Melloc::ThreadDescriptor::DecayPurge,
+                                                std::memory_order_relaxed);
 }
 #endif
 
 /*  tid constructor */
 Melloc::ThreadDescriptor::ThreadDescriptor(std::thread::id tid) 
     : tid(tid)
+    , cache(std::make_unique<void*[]>(mellocConf.tcacheOffsets.back()))
 {
+    static_assert(std::atomic<std::uint8_t>::is_always_lock_free);
 #ifdef __linux__
     sa.sa_sigaction = threadDescriptorSignalHandler;
-    sa.sa_flags = SA_SIGINFO; /* allow passing this ptr thru siginfo_t */
+    sa.sa_flags = SA_SIGINFO | SA_RESTART; /* allow passing this ptr thru siginfo_t */
 
     sev.sigev_value.sival_ptr = this;
-    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_notify = SIGEV_THREAD_ID; /* signal the owner, not any thread */
     sev.sigev_signo = SIGRTMAX;
 
-    myArena = getArena();
-    for (std::atomic_flag& flg : usedFlags) {
-        /* Initializing usedFlags {ATOMIC_FLAG_INIT} may not work for entire array */
-        flg.clear();
-    }
-    /* arm decay timer */
     if (sigaction(SIGRTMAX, &sa, nullptr) == -1) {
         mellocPrint("sigaction bind failed");
-        exit(1);
+        fatal();
+    }
+#endif
+    attach(tid);
+}
+
+/*  Explicit cache constructor */
+Melloc::ThreadDescriptor::ThreadDescriptor(std::size_t arena)
+    : myArena(arena)
+    , cache(std::make_unique<void*[]>(mellocConf.tcacheOffsets.back()))
+{
+    resetCapacity();
+}
+
+Melloc::ThreadDescriptor::~ThreadDescriptor() {
+#ifdef __linux__
+    if (hasTimer) {
+        timer_delete(timerObj);
     }
+#endif
+}
+
+/*  Bind to a (new) thread: pick its arena and arm the purge timer */
+void Melloc::ThreadDescriptor::attach(std::thread::id tid) {
+    this->tid = tid;
+    myArena = getArena();
+    resetCapacity();
+#ifdef __linux__
+    /*  The timer's target thread is fixed at creation, so each attach gets
+        a new one aimed at the calling thread */
+    sev.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
     if (timer_create(CLOCK_REALTIME, &sev, &timerObj) == -1) {
         mellocPrint("timer creation failed");
-        exit(1);
+        fatal();
     }
-    its.it_value.tv_sec = THREAD_PURGE_TIMER; /* time till first tick */
-    its.it_interval.tv_sec = THREAD_PURGE_TIMER; /* repeated tick interval */
+    hasTimer = true;
+
+    /* arm decay timer */
+    its.it_value.tv_sec = mellocConf.purgeMs / 1000; /* time till first tick */
+    its.it_value.tv_nsec = (mellocConf.purgeMs % 1000) * 1000000;
+    its.it_interval = its.it_value; /* repeated tick interval */
     if (timer_settime(timerObj, 0, &its, nullptr) == -1) {
         mellocPrint("timer arming failed");
-        exit(1);
+        fatal();
     }
-#else 
-    myArena = getArena();
-    for (std::atomic_flag& flg : usedFlags) {
-        /* Initializing usedFlags {ATOMIC_FLAG_INIT} may not work for entire array */
-        flg.clear();
+#endif
+}
+
+void Melloc::ThreadDescriptor::resetCapacity() noexcept {
+    capacityBytes = mellocConf.tcacheDefaultTotal();
+    for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+        capacity[i] = mellocConf.tcacheDefaultCapacity[i];
+        pressure[i] = 0;
+        idleTicks[i] = 0;
+        cacheStats[i] = CacheBinStats{};
+    }
+    purgeRequested.store(NoPurge, std::memory_order_relaxed);
+    purgeHeld = false;
+}
+
+/*  Owning thread exited: flush the cache and delete the purge timer */
+void Melloc::ThreadDescriptor::detach() noexcept {
+#ifdef __linux__
+    if (hasTimer && timer_delete(timerObj) == -1) {
+        mellocPrint("timer deletion failed");
     }
+    hasTimer = false;
 #endif
+    flush();
+    mellocPrint("detached thread 0x%x", this->tid);
 }
 
 /*  Pushes a chunk pointer onto thread's cache */
 void Melloc::ThreadDescriptor::pushCache(void* ptr, std::size_t sizeClassIdx) noexcept {
-    assert(sizeClassIdx >= 0);
     assert(sizeClassIdx < smallSizeClasses.size());
-    AtomicFlagGuard g(usedFlags[sizeClassIdx]);
+    servicePurge();
         
     decayRate[sizeClassIdx] = 1;
     std::size_t topIdx = topIdxs[sizeClassIdx];
-    assert(topIdx >= 0);
-    assert(topIdx <= THREAD_CACHE_SIZE);
-    if (topIdx < THREAD_CACHE_SIZE) {
+    assert(topIdx <= capacity[sizeClassIdx]);
+    if (topIdx == capacity[sizeClassIdx]) {
+        ++cacheStats[sizeClassIdx].overflows;
+        if (++pressure[sizeClassIdx] >= mellocConf.tcacheGrowEvents) {
+            grow(sizeClassIdx);
+        }
+    }
+    if (topIdx < capacity[sizeClassIdx]) {
         ++topIdxs[sizeClassIdx];
-        cache[sizeClassIdx][topIdx] = ptr;
+        cacheBin(sizeClassIdx)[topIdx] = ptr;
         mellocPrint("inserted ptr 0x%x into threadDescriptor for sizeClass %zu",
             ptr, smallSizeClasses[sizeClassIdx]);
     }
     else {
         /* if no space, then return to bin immediately */
-        arenas[myArena].bins[sizeClassIdx].giveBack(ptr);
+        arenas[myArena]->bins[sizeClassIdx].giveBack(ptr);
     }
 }
 
 /*  Retrieves a chunk pointer from thread's cache. If cache is empty,
     returns nulltpr */
 void* Melloc::ThreadDescriptor::popCache(std::size_t sizeClassIdx) noexcept {
-    assert(sizeClassIdx >= 0);
     assert(sizeClassIdx < smallSizeClasses.size());
-    AtomicFlagGuard g(usedFlags[sizeClassIdx]);
+    servicePurge();
 
     decayRate[sizeClassIdx] = 1;
     std::size_t topIdx = topIdxs[sizeClassIdx];
-    assert(topIdx >= 0);
-    assert(topIdx <= THREAD_CACHE_SIZE);
+    assert(topIdx <= capacity[sizeClassIdx]);
     if (topIdx > 0) {
+        ++cacheStats[sizeClassIdx].hits;
         --topIdxs[sizeClassIdx];
-        return cache[sizeClassIdx][topIdx];
+        return cacheBin(sizeClassIdx)[topIdx - 1];
+    }
+    ++cacheStats[sizeClassIdx].misses;
+    if (++pressure[sizeClassIdx] >= mellocConf.tcacheGrowEvents) {
+        grow(sizeClassIdx);
     }
     return nullptr;
 }
 
-/*  Exponentially decays existing buffer, slowly at first */
-void Melloc::ThreadDescriptor::decay(std::size_t sizeClassIdx) noexcept {
-    assert(sizeClassIdx > 0);
-    topIdxs[sizeClassIdx] -= std::min(topIdxs[sizeClassIdx],
-        decayRate[sizeClassIdx]);
-    decayRate[sizeClassIdx] = std::max(decayRate[sizeClassIdx] << 1,
-        THREAD_CACHE_SIZE);
+/*  Pushes as many of ptrs as fit onto thread's cache, returns how many did */
+std::size_t Melloc::ThreadDescriptor::pushCacheBatch(void** ptrs, std::size_t count,
+    std::size_t sizeClassIdx) noexcept {
+    assert(sizeClassIdx < smallSizeClasses.size());
+    servicePurge();
+
+    decayRate[sizeClassIdx] = 1;
+    std::size_t topIdx = topIdxs[sizeClassIdx];
+    std::size_t n = std::min(count, capacity[sizeClassIdx] - topIdx);
+    std::copy(ptrs, ptrs + n, cacheBin(sizeClassIdx) + topIdx);
+    topIdxs[sizeClassIdx] += n;
+    return n;
+}
+
+/*  Pops up to count chunk pointers from thread's cache, returns how many */
+std::size_t Melloc::ThreadDescriptor::popCacheBatch(void** out, std::size_t count,
+    std::size_t sizeClassIdx) noexcept {
+    assert(sizeClassIdx < smallSizeClasses.size());
+    servicePurge();
+
+    decayRate[sizeClassIdx] = 1;
+    std::size_t topIdx = topIdxs[sizeClassIdx];
+    std::size_t n = std::min(count, topIdx);
+    std::copy(cacheBin(sizeClassIdx) + (topIdx - n),
+              cacheBin(sizeClassIdx) + topIdx, out);
+    topIdxs[sizeClassIdx] -= n;
+    return n;
+}
+
+/*  Refill half the capacity on a miss, like jemalloc, so that a bigger cache
+    also means fewer trips to the bin */
+std::size_t Melloc::ThreadDescriptor::fillCount(std::size_t sizeClassIdx) const noexcept {
+    return std::max<std::size_t>(capacity[sizeClassIdx] / 2, 1);
 }
 
-/*  Do garbage collection for all size classes in specific thread  */
+/*  Double a cache bin's capacity. Called after repeated misses or overflows */
+void Melloc::ThreadDescriptor::grow(std::size_t sizeClassIdx) noexcept {
+    std::size_t sizeClass = smallSizeClasses[sizeClassIdx];
+    std::size_t budgetLeft = capacityBytes < mellocConf.tcacheBudget
+        ? (mellocConf.tcacheBudget - capacityBytes) / sizeClass
+        : 0;
+    std::size_t grown = std::min({capacity[sizeClassIdx] * 2,
+                                  mellocConf.tcacheMaxCapacity[sizeClassIdx],
+                                  capacity[sizeClassIdx] + budgetLeft});
+    pressure[sizeClassIdx] = 0;
+    if (grown == capacity[sizeClassIdx]) {
+        return;
+    }
+    capacityBytes += (grown - capacity[sizeClassIdx]) * sizeClass;
+    capacity[sizeClassIdx] = grown;
+    mellocPrint("thread cache for sizeClass %zu grew to %zu", sizeClass, grown);
+}
+
+/*  Halve a cache bin's capacity */
+void Melloc::ThreadDescriptor::shrink(std::size_t sizeClassIdx) noexcept {
+    std::size_t sizeClass = smallSizeClasses[sizeClassIdx];
+    std::size_t shrunk = std::max(capacity[sizeClassIdx] / 2, mellocConf.tcacheMin);
+    while (topIdxs[sizeClassIdx] > shrunk) {
+        arenas[myArena]->bins[sizeClassIdx].giveBack(
+            cacheBin(sizeClassIdx)[--topIdxs[sizeClassIdx]]);
+    }
+    capacityBytes -= (capacity[sizeClassIdx] - shrunk) * sizeClass;
+    capacity[sizeClassIdx] = shrunk;
+    pressure[sizeClassIdx] = 0;
+}
+
+/*  Do garbage collection for all size classes in specific thread. A class
+    that saw no pushes or pops for decayTicks ticks also shrinks */
 void Melloc::ThreadDescriptor::purge() {
     mellocPrint("purging thread 0x%x", this->tid);
+    std::size_t purged = 0;
+    std::size_t purgedBytes = 0;
     for (int i = 0; i < smallSizeClasses.size(); ++i) {
-        AtomicFlagGuard g(usedFlags[i]);
-        if (!topIdxs[i]) {
-            continue;
+        std::size_t before = topIdxs[i];
+        idleTicks[i] = decayRate[i] > 1 ? idleTicks[i] + 1 : 0;
+        if (idleTicks[i] >= mellocConf.decayTicks) {
+            shrink(i);
         }
         std::size_t discards = std::min(decayRate[i], topIdxs[i]);
-        assert(discards < THREAD_CACHE_SIZE);
-        std::size_t topIdx = topIdxs[i]-1, botIdx = 1 + topIdx - discards;
-        for ( ; topIdx > botIdx; --topIdx) {
-            arenas[myArena].bins[i].giveBack(cache[i][topIdx]);
+        for ( ; discards > 0; --discards) {
+            arenas[myArena]->bins[i].giveBack(cacheBin(i)[--topIdxs[i]]);
+        }
+        if (decayRate[i] > 0) {
+            decayRate[i] = std::min(decayRate[i] << 1, mellocConf.tcacheMax);
         }
-        arenas[myArena].bins[i].giveBack(cache[i][botIdx]); /* edge case decrementing size_t past 0*/
-        topIdxs[i] = botIdx;
-        decayRate[i] = std::max(THREAD_CACHE_SIZE, decayRate[i] << 1);
+        purged += before - topIdxs[i];
+        purgedBytes += (before - topIdxs[i]) * smallSizeClasses[i];
     }
-}
\ No newline at end of file
+    MELLOC_PROBE(tcache_purge, myArena, purged, purgedBytes);
+}
+
+/*  Give every cached chunk back to its bin */
+void Melloc::ThreadDescriptor::flush() noexcept {
+    for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+        while (topIdxs[i] > 0) {
+            arenas[myArena]->bins[i].giveBack(cacheBin(i)[--topIdxs[i]]);
+        }
+        decayRate[i] = 0;
+    }
+}
+
+/*  A zero it_value disarms the timer */
+void Melloc::ThreadDescriptor::pausePurge() noexcept {
+    purgeHeld = true;
+#ifdef __linux__
+    struct itimerspec disarm {};
+    if (hasTimer && timer_settime(timerObj, 0, &disarm, nullptr) == -1) {
+        mellocPrint("timer disarming failed");
+    }
+#endif
+}
+
+void Melloc::ThreadDescriptor::resumePurge() noexcept {
+    purgeHeld = false;
+#ifdef __linux__
+    if (hasTimer && timer_settime(timerObj, 0, &its, nullptr) == -1) {
+        mellocPrint("timer arming failed");
+    }
+#endif
+    servicePurge();
+}
+
+/*  Flush and halve every cache bin's capacity, under memory pressure */
+void Melloc::ThreadDescriptor::release() noexcept {
+    flush();
+    for (std::size_t i = 0; i < smallSizeClasses.size(); ++i) {
+        shrink(i);
+    }
+    mellocPrint("released cache of thread 0x%x", this->tid);
+}
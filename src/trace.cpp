@@ -0,0 +1,109 @@
+/**
+ * @file trace.cpp
+ *
+ * @author Gavin Dan (xfdan10@gmail.com)
+ * @brief Allocation trace recording
+ * @version 1.0
+ * @date 2023-11-12
+ *
+ *
+ * Each thread fills its own buffer without locking. Only writing a full
+ * buffer to the file takes traceMut. The file descriptor is never closed, so
+ * threads exiting during process teardown can still flush.
+ *
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif // __linux__
+
+#include "melloc_defs.h"
+#include "melloc_trace.h"
+
+
+static int                                      traceFd {-1};
+static std::mutex                               traceMut;
+static std::atomic<std::uint64_t>               traceSeq {0};
+static std::atomic<std::uint16_t>               traceThreads {0};
+static std::chrono::steady_clock::time_point    traceStart;
+
+/*  Write all of buf, retrying short writes */
+static void traceWrite(const void* buf, std::size_t len) noexcept {
+#ifdef __linux__
+    const char* c = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t wrote = write(traceFd, c, len);
+        if (wrote <= 0) {
+            return;
+        }
+        c += wrote;
+        len -= wrote;
+    }
+#endif // __linux__
+}
+
+struct TraceBuffer {
+    TraceBuffer() : thread(traceThreads.fetch_add(1, std::memory_order_relaxed)) {}
+
+    ~TraceBuffer() {
+        flush();
+    }
+
+    void flush() noexcept {
+        std::unique_lock writeLock(traceMut);
+        traceWrite(records.data(), count * sizeof(TraceRecord));
+        count = 0;
+    }
+
+    std::array<TraceRecord, TRACE_BUFFER_RECORDS>   records;
+    std::size_t                                     count   {0};
+    std::uint16_t                                   thread;
+};
+
+bool traceOpen() noexcept {
+#ifdef __linux__
+    const char* path = std::getenv("MELLOC_TRACE_FILE");
+    if (!path || !*path) {
+        return false;
+    }
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (traceFd == -1) {
+        return false;
+    }
+    TraceHeader header {};
+    std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    traceWrite(&header, sizeof(header));
+    traceStart = std::chrono::steady_clock::now();
+    return true;
+#else
+    return false;
+#endif // __linux__
+}
+
+void traceRecord(TraceOp op, std::size_t size, void* ptr) noexcept {
+    thread_local TraceBuffer buffer;
+    if (buffer.count == buffer.records.size()) {
+        buffer.flush();
+    }
+    TraceRecord& rec = buffer.records[buffer.count++];
+    rec.seq = traceSeq.fetch_add(1, std::memory_order_relaxed);
+    rec.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - traceStart).count();
+    rec.ptr = reinterpret_cast<std::uintptr_t>(ptr);
+    rec.size = static_cast<std::uint32_t>(
+        std::min<std::size_t>(size, std::numeric_limits<std::uint32_t>::max()));
+    rec.thread = buffer.thread;
+    rec.op = op;
+    rec.reserved = 0;
+}